@@ -0,0 +1,533 @@
+// End-to-end benchmark of a backup job. Generates a synthetic source tree,
+// times the initial sync, then replays a random workload of creates,
+// modifications, renames and deletes at a fixed rate while the job runs,
+// and reports the event rate, the replication lag and how far the backup
+// diverged from the source once the job caught up.
+//
+// Usage: replication_bench [-d depth] [-w fanout] [-n files_per_dir]
+//          [-s min_kib] [-S max_kib] [-p sparse_pct] [-l symlink_pct]
+//          [-r ops_per_sec] [-t seconds] [-x seed] [-- add options]
+// Anything after -- is parsed like the options of the add command.
+#define SOP_BACKUP_NO_MAIN
+#include "../src/projekt.c"
+
+#define MAX_BENCH_FILES 100000
+#define MAX_BENCH_DIRS 10000
+#define BENCH_STEP_MS 50
+// The job counts as caught up after this long without a single event.
+#define BENCH_IDLE_MS 500
+
+struct BenchConfig {
+  int depth;
+  int fanout;
+  int files_per_dir;
+  long long min_size;
+  long long max_size;
+  int sparse_pct;
+  int symlink_pct;
+  int ops_per_sec;
+  int seconds;
+  uint64_t seed;
+};
+
+// The tree as the generator and the replayer know it, paths relative to
+// the source root.
+struct BenchTree {
+  char src[PATH_MAX];
+  char *dirs[MAX_BENCH_DIRS];
+  int dir_count;
+  char *files[MAX_BENCH_FILES];
+  int file_count;
+  int next_name;
+  long long bytes;
+  uint64_t rng;
+};
+
+struct BenchOps {
+  int creates;
+  int modifies;
+  int renames;
+  int deletes;
+};
+
+uint64_t next_random(struct BenchTree *tree) {
+  tree->rng ^= tree->rng << 13;
+  tree->rng ^= tree->rng >> 7;
+  tree->rng ^= tree->rng << 17;
+  return tree->rng;
+}
+
+int random_below(struct BenchTree *tree, int n) {
+  return n > 0 ? next_random(tree) % n : 0;
+}
+
+// File sizes are spread evenly over the powers of two between the bounds,
+// so most files are small and a few are large, as in real trees.
+long long random_size(struct BenchTree *tree, const struct BenchConfig *cfg) {
+  int low = 63 - __builtin_clzll(cfg->min_size);
+  int high = 63 - __builtin_clzll(cfg->max_size);
+  int bits = low + random_below(tree, high - low + 1);
+  long long size = (1LL << bits) + next_random(tree) % (1ULL << bits);
+  if (size < cfg->min_size) {
+    return cfg->min_size;
+  }
+  return size > cfg->max_size ? cfg->max_size : size;
+}
+
+void full_path(const struct BenchTree *tree, const char *rel, char *path) {
+  snprintf(path, PATH_MAX, "%s%s", tree->src, rel);
+}
+
+void write_random(struct BenchTree *tree, int fd, off_t offset, long long len) {
+  char buf[64 * 1024];
+  while (len > 0) {
+    size_t chunk = len < (long long)sizeof(buf) ? (size_t)len : sizeof(buf);
+    for (size_t i = 0; i < chunk; i += sizeof(uint64_t)) {
+      uint64_t value = next_random(tree);
+      memcpy(buf + i, &value,
+             chunk - i < sizeof(value) ? chunk - i : sizeof(value));
+    }
+    if (pwrite_all(fd, buf, chunk, offset) < 0) {
+      ERR("pwrite");
+    }
+    offset += chunk;
+    len -= chunk;
+  }
+}
+
+// Sparse files get a few data blocks scattered over a hole of their size.
+void make_file(struct BenchTree *tree, const struct BenchConfig *cfg,
+               const char *rel) {
+  char path[PATH_MAX];
+  full_path(tree, rel, path);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ERR("open");
+  }
+
+  long long size = random_size(tree, cfg);
+  if (random_below(tree, 100) < cfg->sparse_pct) {
+    if (ftruncate(fd, size) < 0) {
+      ERR("ftruncate");
+    }
+    for (int i = 0; i < 4; i++) {
+      off_t offset = (next_random(tree) % (size / 4096 + 1)) * 4096;
+      long long len = size - offset < 4096 ? size - offset : 4096;
+      write_random(tree, fd, offset, len);
+      tree->bytes += len;
+    }
+  } else {
+    write_random(tree, fd, 0, size);
+    tree->bytes += size;
+  }
+  close(fd);
+}
+
+char *new_name(struct BenchTree *tree, const char *dir, const char *kind) {
+  char rel[PATH_MAX];
+  snprintf(rel, sizeof(rel), "%s/%s-%d", dir, kind, tree->next_name++);
+  return strdup(rel);
+}
+
+void add_file(struct BenchTree *tree, char *rel) {
+  if (tree->file_count == MAX_BENCH_FILES) {
+    fprintf(stderr, "too many files\n");
+    exit(EXIT_FAILURE);
+  }
+  tree->files[tree->file_count++] = rel;
+}
+
+// Symlinks point at a sibling file with a relative target, so the same
+// link is correct in the backup.
+void make_symlink(struct BenchTree *tree, const char *dir, const char *target) {
+  char *rel = new_name(tree, dir, "link");
+  char path[PATH_MAX];
+  full_path(tree, rel, path);
+  if (symlink(strrchr(target, '/') + 1, path) < 0) {
+    ERR("symlink");
+  }
+  free(rel);
+}
+
+void generate_dir(struct BenchTree *tree, const struct BenchConfig *cfg,
+                  const char *dir, int depth) {
+  char path[PATH_MAX];
+  full_path(tree, dir, path);
+  if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+    ERR("mkdir");
+  }
+  if (tree->dir_count == MAX_BENCH_DIRS) {
+    fprintf(stderr, "too many directories\n");
+    exit(EXIT_FAILURE);
+  }
+  tree->dirs[tree->dir_count++] = strdup(dir);
+
+  for (int i = 0; i < cfg->files_per_dir; i++) {
+    char *rel = new_name(tree, dir, "file");
+    make_file(tree, cfg, rel);
+    add_file(tree, rel);
+    if (random_below(tree, 100) < cfg->symlink_pct) {
+      make_symlink(tree, dir, rel);
+    }
+  }
+
+  for (int i = 0; depth > 0 && i < cfg->fanout; i++) {
+    char child[PATH_MAX];
+    snprintf(child, sizeof(child), "%s/dir-%d", dir, i);
+    generate_dir(tree, cfg, child, depth - 1);
+  }
+}
+
+// One random change to the tree. Files are never renamed over each other,
+// so every path the replayer knows stays valid.
+void replay_op(struct BenchTree *tree, const struct BenchConfig *cfg,
+               struct BenchOps *ops) {
+  int roll = random_below(tree, 100);
+  char path[PATH_MAX];
+
+  if (tree->file_count < 2 || roll < 30) {
+    const char *dir = tree->dirs[random_below(tree, tree->dir_count)];
+    char *rel = new_name(tree, dir, "file");
+    make_file(tree, cfg, rel);
+    add_file(tree, rel);
+    ops->creates++;
+    return;
+  }
+
+  int idx = random_below(tree, tree->file_count);
+  char *rel = tree->files[idx];
+  full_path(tree, rel, path);
+
+  if (roll < 70) {
+    // Half appends, half overwrites somewhere in the file.
+    int fd = open(path, O_WRONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      ERR("open");
+    }
+    long long len = 4096 + random_below(tree, 64 * 1024);
+    off_t offset = roll < 50 ? st.st_size
+                             : random_below(tree, st.st_size + 1);
+    write_random(tree, fd, offset, len);
+    close(fd);
+    ops->modifies++;
+  } else if (roll < 85) {
+    const char *dir = tree->dirs[random_below(tree, tree->dir_count)];
+    char *moved = new_name(tree, dir, "moved");
+    char moved_path[PATH_MAX];
+    full_path(tree, moved, moved_path);
+    if (rename(path, moved_path) < 0) {
+      ERR("rename");
+    }
+    free(rel);
+    tree->files[idx] = moved;
+    ops->renames++;
+  } else {
+    if (unlink(path) < 0) {
+      ERR("unlink");
+    }
+    free(rel);
+    tree->files[idx] = tree->files[--tree->file_count];
+    ops->deletes++;
+  }
+}
+
+struct Replayer {
+  struct BenchTree *tree;
+  const struct BenchConfig *cfg;
+  struct BenchOps ops;
+  atomic_int done;
+};
+
+// Spreads the operations evenly over the run, catching up after a slow
+// one instead of drifting.
+void *replay(void *arg) {
+  struct Replayer *replayer = arg;
+  const struct BenchConfig *cfg = replayer->cfg;
+  long long total = (long long)cfg->ops_per_sec * cfg->seconds;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (long long i = 0; i < total; i++) {
+    unsigned long long due = i * 1000000000ULL / cfg->ops_per_sec;
+    unsigned long long now = elapsed_ns(&start);
+    if (due > now) {
+      struct timespec pause = {.tv_sec = (due - now) / 1000000000ULL,
+                               .tv_nsec = (due - now) % 1000000000ULL};
+      nanosleep(&pause, NULL);
+    }
+    replay_op(replayer->tree, cfg, &replayer->ops);
+  }
+  atomic_store(&replayer->done, 1);
+  return NULL;
+}
+
+// Runs the job for one step, waiting at most BENCH_STEP_MS for events.
+// Returns the number of events read.
+unsigned long long bench_step(struct Monitor *m) {
+  int timeout = monitor_timeout(m);
+  if (timeout < 0 || timeout > BENCH_STEP_MS) {
+    timeout = BENCH_STEP_MS;
+  }
+  struct pollfd pfd = {.fd = m->notify_fd, .events = POLLIN};
+  poll(&pfd, 1, timeout);
+
+  unsigned long long before = atomic_load(&m->status->events);
+  if (monitor_step(m) < 0) {
+    fprintf(stderr, "job ended\n");
+    exit(EXIT_FAILURE);
+  }
+  return atomic_load(&m->status->events) - before;
+}
+
+struct Divergence {
+  long missing;
+  long extra;
+  long differing;
+};
+
+int same_content(const char *a, const char *b) {
+  int fa = open(a, O_RDONLY);
+  int fb = open(b, O_RDONLY);
+  int same = fa >= 0 && fb >= 0;
+  char buf_a[64 * 1024], buf_b[64 * 1024];
+
+  while (same) {
+    ssize_t la = bulk_read(fa, buf_a, sizeof(buf_a));
+    ssize_t lb = bulk_read(fb, buf_b, sizeof(buf_b));
+    same = la == lb && la >= 0 && memcmp(buf_a, buf_b, la) == 0;
+    if (la <= 0) {
+      break;
+    }
+  }
+  if (fa >= 0) {
+    close(fa);
+  }
+  if (fb >= 0) {
+    close(fb);
+  }
+  return same;
+}
+
+void compare_trees(const char *src, const char *dst, int is_root,
+                   struct Divergence *div) {
+  DIR *d = opendir(src);
+  struct dirent *entry;
+  if (d == NULL) {
+    ERR("opendir");
+  }
+  while ((entry = readdir(d)) != NULL) {
+    const char *name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+
+    char src_path[PATH_MAX], dst_path[PATH_MAX];
+    struct stat src_st, dst_st;
+    snprintf(src_path, sizeof(src_path), "%s/%s", src, name);
+    snprintf(dst_path, sizeof(dst_path), "%s/%s", dst, name);
+    if (lstat(src_path, &src_st) < 0) {
+      continue;
+    }
+    if (lstat(dst_path, &dst_st) < 0) {
+      div->missing++;
+      continue;
+    }
+
+    if ((src_st.st_mode & S_IFMT) != (dst_st.st_mode & S_IFMT)) {
+      div->differing++;
+    } else if (S_ISDIR(src_st.st_mode)) {
+      compare_trees(src_path, dst_path, 0, div);
+    } else if (S_ISLNK(src_st.st_mode)) {
+      char a[PATH_MAX] = "", b[PATH_MAX] = "";
+      if (readlink(src_path, a, sizeof(a) - 1) < 0 ||
+          readlink(dst_path, b, sizeof(b) - 1) < 0 || strcmp(a, b) != 0) {
+        div->differing++;
+      }
+    } else if (src_st.st_size != dst_st.st_size ||
+               !same_content(src_path, dst_path)) {
+      div->differing++;
+    }
+  }
+  closedir(d);
+
+  // Whatever the backup has beyond the source, apart from its metadata.
+  d = opendir(dst);
+  if (d == NULL) {
+    ERR("opendir");
+  }
+  while ((entry = readdir(d)) != NULL) {
+    const char *name = entry->d_name;
+    char src_path[PATH_MAX];
+    struct stat st;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        (is_root && is_meta_name(name))) {
+      continue;
+    }
+    snprintf(src_path, sizeof(src_path), "%s/%s", src, name);
+    if (lstat(src_path, &st) < 0) {
+      div->extra++;
+    }
+  }
+  closedir(d);
+}
+
+void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-d depth] [-w fanout] [-n files_per_dir] [-s min_kib] "
+          "[-S max_kib] [-p sparse_pct] [-l symlink_pct] [-r ops_per_sec] "
+          "[-t seconds] [-x seed] [-- add options]\n",
+          name);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  struct BenchConfig cfg = {.depth = 3,
+                            .fanout = 4,
+                            .files_per_dir = 10,
+                            .min_size = 1024,
+                            .max_size = 256 * 1024,
+                            .sparse_pct = 5,
+                            .symlink_pct = 5,
+                            .ops_per_sec = 200,
+                            .seconds = 5,
+                            .seed = 42};
+  int c;
+  while ((c = getopt(argc, argv, "d:w:n:s:S:p:l:r:t:x:")) != -1) {
+    switch (c) {
+      case 'd':
+        cfg.depth = atoi(optarg);
+        break;
+      case 'w':
+        cfg.fanout = atoi(optarg);
+        break;
+      case 'n':
+        cfg.files_per_dir = atoi(optarg);
+        break;
+      case 's':
+        cfg.min_size = atoll(optarg) * 1024;
+        break;
+      case 'S':
+        cfg.max_size = atoll(optarg) * 1024;
+        break;
+      case 'p':
+        cfg.sparse_pct = atoi(optarg);
+        break;
+      case 'l':
+        cfg.symlink_pct = atoi(optarg);
+        break;
+      case 'r':
+        cfg.ops_per_sec = atoi(optarg);
+        break;
+      case 't':
+        cfg.seconds = atoi(optarg);
+        break;
+      case 'x':
+        cfg.seed = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (cfg.depth < 0 || cfg.fanout < 0 || cfg.files_per_dir < 0 ||
+      cfg.min_size < 1 || cfg.max_size < cfg.min_size ||
+      cfg.ops_per_sec < 1 || cfg.seconds < 0) {
+    usage(argv[0]);
+  }
+
+  // The rest are the options of the job, as add takes them.
+  args[arg_count++] = (char *)"add";
+  for (int i = optind; i < argc && arg_count < MAX_ARGS; i++) {
+    args[arg_count++] = argv[i];
+  }
+  struct JobOptions opts;
+  if (parse_add_options(&opts) != arg_count) {
+    usage(argv[0]);
+  }
+
+  char base[] = "/tmp/sop-replication-bench-XXXXXX";
+  if (mkdtemp(base) == NULL) {
+    ERR("mkdtemp");
+  }
+  char dst[PATH_MAX];
+  char *dsts[] = {dst};
+  snprintf(dst, sizeof(dst), "%s/backup", base);
+  if (mkdir(dst, 0755) < 0) {
+    ERR("mkdir");
+  }
+
+  static struct BenchTree tree;
+  tree.rng = cfg.seed ? cfg.seed : 1;
+  snprintf(tree.src, sizeof(tree.src), "%s/source", base);
+  generate_dir(&tree, &cfg, "", cfg.depth);
+  printf("tree: depth %d, fanout %d, %d directories, %d files, %.1f MiB\n",
+         cfg.depth, cfg.fanout, tree.dir_count, tree.file_count,
+         tree.bytes / (1024.0 * 1024.0));
+
+  struct Monitor *m = monitor_new(tree.src, dsts, 1, &opts, NULL);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (monitor_start(m) != 0) {
+    ERR("monitor_start");
+  }
+  // The initial sync runs in the background while the job reads events.
+  while (atomic_load(&m->scan_running)) {
+    bench_step(m);
+  }
+  double secs = elapsed_ns(&start) / 1e9;
+  printf("initial sync: %.2f s, %.1f MiB/s, %.0f files/s\n", secs,
+         tree.bytes / (1024.0 * 1024.0) / secs, tree.file_count / secs);
+
+  struct Replayer replayer = {.tree = &tree, .cfg = &cfg};
+  pthread_t thread;
+  unsigned long long events_before = atomic_load(&m->status->events);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (pthread_create(&thread, NULL, replay, &replayer) != 0) {
+    ERR("pthread_create");
+  }
+  while (!atomic_load(&replayer.done)) {
+    bench_step(m);
+  }
+  pthread_join(thread, NULL);
+  double replay_secs = elapsed_ns(&start) / 1e9;
+
+  // Let the job finish what the workload left behind.
+  struct timespec idle;
+  clock_gettime(CLOCK_MONOTONIC, &idle);
+  while (elapsed_ns(&idle) < BENCH_IDLE_MS * 1000000ULL ||
+         atomic_load(&m->work.depth) > 0 || m->dirty.count > 0 ||
+         m->move_count > 0) {
+    if (bench_step(m) > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &idle);
+    }
+  }
+  work_wait_idle(&m->work);
+  double drain_secs = elapsed_ns(&start) / 1e9 - replay_secs;
+
+  unsigned long long events = atomic_load(&m->status->events) - events_before;
+  struct BenchOps *ops = &replayer.ops;
+  int op_count = ops->creates + ops->modifies + ops->renames + ops->deletes;
+  printf("workload: %d ops in %.2f s (%d creates, %d modifications, "
+         "%d renames, %d deletes)\n",
+         op_count, replay_secs, ops->creates, ops->modifies, ops->renames,
+         ops->deletes);
+  printf("steady state: %.0f events/s, caught up %.2f s after the workload\n",
+         events / replay_secs, drain_secs);
+  print_latency(m->status);
+
+  monitor_stop(m);
+  struct Divergence div = {0};
+  compare_trees(tree.src, dst, 1, &div);
+  printf("divergence: %ld missing, %ld extra, %ld differing\n", div.missing,
+         div.extra, div.differing);
+
+  monitor_free(m);
+  remove_recursive(base);
+  for (int i = 0; i < tree.dir_count; i++) {
+    free(tree.dirs[i]);
+  }
+  for (int i = 0; i < tree.file_count; i++) {
+    free(tree.files[i]);
+  }
+  return div.missing || div.extra || div.differing ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,159 @@
+// Benchmark of the tree walkers on a deep, wide synthetic tree. Compares
+// the fd-relative getdents64/d_type walk against the readdir + full path
+// lstat walk the backup used to do, both for a read-only scan and for
+// removing the tree.
+#define SOP_BACKUP_NO_MAIN
+#include "../src/projekt.c"
+
+#define TREE_DEPTH 4
+#define TREE_WIDTH 6
+#define FILES_PER_DIR 20
+#define WALK_ROUNDS 5
+
+long make_tree(const char *path, int depth) {
+  long count = 0;
+
+  if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+    ERR("mkdir");
+  }
+
+  for (int i = 0; i < FILES_PER_DIR; i++) {
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/file-with-a-longer-name-%d", path, i);
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      ERR("open");
+    }
+    close(fd);
+    count++;
+  }
+
+  for (int i = 0; depth > 0 && i < TREE_WIDTH; i++) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/directory-%d", path, i);
+    count += make_tree(dir, depth - 1) + 1;
+  }
+  return count;
+}
+
+long path_walk(const char *path) {
+  DIR *d = opendir(path);
+  struct dirent *entry;
+  long count = 0;
+
+  if (d == NULL) {
+    ERR("opendir");
+  }
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+
+    char child[PATH_MAX];
+    struct stat st;
+    snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+    if (lstat(child, &st) < 0) {
+      ERR("lstat");
+    }
+    count++;
+    if (S_ISDIR(st.st_mode)) {
+      count += path_walk(child);
+    }
+  }
+  closedir(d);
+  return count;
+}
+
+long fd_walk(int fd) {
+  struct DirReader dir;
+  struct dirent64 *entry;
+  long count = 0;
+
+  dir_open(&dir, fd);
+  while ((entry = dir_next(&dir)) != NULL) {
+    count++;
+    if (dir_entry_type(fd, entry) == DT_DIR) {
+      int child = open_dir_at(fd, entry->d_name);
+      if (child < 0) {
+        ERR("openat");
+      }
+      count += fd_walk(child);
+    }
+  }
+  dir_close(&dir);
+  return count;
+}
+
+int path_remove(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) < 0) {
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return unlink(path);
+  }
+
+  DIR *d = opendir(path);
+  struct dirent *entry;
+  if (d == NULL) {
+    ERR("opendir");
+  }
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char child[PATH_MAX];
+    snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+    path_remove(child);
+  }
+  closedir(d);
+  return rmdir(path);
+}
+
+int main() {
+  char base[] = "/tmp/sop-walk-bench-XXXXXX";
+  if (mkdtemp(base) == NULL) {
+    ERR("mkdtemp");
+  }
+
+  char tree[PATH_MAX];
+  snprintf(tree, sizeof(tree), "%s/tree", base);
+  long entries = make_tree(tree, TREE_DEPTH);
+  printf("tree: depth %d, width %d, %ld entries\n", TREE_DEPTH, TREE_WIDTH,
+         entries);
+  printf("%-8s %16s %16s\n", "", "path+lstat ms", "fd+getdents ms");
+
+  struct timespec start;
+  long counted = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < WALK_ROUNDS; i++) {
+    counted += path_walk(tree);
+  }
+  double path_ms = elapsed_ns(&start) / 1e6 / WALK_ROUNDS;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < WALK_ROUNDS; i++) {
+    counted -= fd_walk(open_dir_at(AT_FDCWD, tree));
+  }
+  double fd_ms = elapsed_ns(&start) / 1e6 / WALK_ROUNDS;
+
+  if (counted != 0) {
+    fprintf(stderr, "walks disagree on the entry count\n");
+    return EXIT_FAILURE;
+  }
+  printf("%-8s %16.1f %16.1f\n", "walk", path_ms, fd_ms);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  path_remove(tree);
+  path_ms = elapsed_ns(&start) / 1e6;
+
+  make_tree(tree, TREE_DEPTH);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  remove_recursive(tree);
+  fd_ms = elapsed_ns(&start) / 1e6;
+  printf("%-8s %16.1f %16.1f\n", "remove", path_ms, fd_ms);
+
+  rmdir(base);
+  return 0;
+}
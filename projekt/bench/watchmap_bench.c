@@ -0,0 +1,71 @@
+// Micro-benchmark of the WatchMap lookup done for every inotify event.
+// Compares find_watch() against the linear scan the map used to do.
+#define SOP_BACKUP_NO_MAIN
+#include "../src/projekt.c"
+
+#define LOOKUPS 2000000
+
+struct Watch *linear_find(struct Watch *watches, int count, int wd) {
+  for (int i = 0; i < count; i++) {
+    if (watches[i].wd == wd) {
+      return &watches[i];
+    }
+  }
+  return NULL;
+}
+
+int main() {
+  int sizes[] = {16, 256, 1024, 8192, 65536};
+  int size_count = sizeof(sizes) / sizeof(sizes[0]);
+
+  printf("%10s %14s %14s\n", "watches", "hash ns/event", "linear ns/event");
+
+  for (int s = 0; s < size_count; s++) {
+    int n = sizes[s];
+    struct WatchMap map = {0};
+    struct Watch *linear = calloc(n, sizeof(struct Watch));
+    if (linear == NULL) {
+      ERR("calloc");
+    }
+
+    for (int i = 0; i < n; i++) {
+      char path[64];
+      snprintf(path, sizeof(path), "/src/dir%d", i);
+      add_to_map(&map, i + 1, path);
+      linear[i].wd = i + 1;
+    }
+
+    int *wds = malloc(LOOKUPS * sizeof(int));
+    if (wds == NULL) {
+      ERR("malloc");
+    }
+    srand(n);
+    for (int i = 0; i < LOOKUPS; i++) {
+      wds[i] = rand() % n + 1;
+    }
+
+    volatile uintptr_t sink = 0;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < LOOKUPS; i++) {
+      sink += (uintptr_t)find_watch(&map, wds[i]);
+    }
+    double hash_ns = (double)elapsed_ns(&start) / LOOKUPS;
+
+    // The linear scan gets slow quickly, so it is sampled less.
+    int linear_lookups = LOOKUPS / (n > 1024 ? 100 : 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < linear_lookups; i++) {
+      sink += (uintptr_t)linear_find(linear, n, wds[i]);
+    }
+    double linear_ns = (double)elapsed_ns(&start) / linear_lookups;
+
+    printf("%10d %14.1f %14.1f\n", n, hash_ns, linear_ns);
+
+    free(wds);
+    free(linear);
+    free_map(&map);
+  }
+  return 0;
+}
@@ -4,12 +4,25 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/fs.h>
+#include <linux/ioprio.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -21,29 +34,333 @@
 
 #define MAX_CMD_LEN 1024
 #define MAX_ARGS 64
-#define MAX_JOBS 32
+#define MAX_JOBS 512
 #define COPY_BUF_SIZE 4096
+#define COPY_CHUNK_SIZE (64 * 1024 * 1024)
 #define EVENT_BUF_LEN (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
-#define MAX_WATCHES 8192
+// What the filesystem-wide fanotify mark listens for. Renames come as one
+// event carrying both names.
+#define FANOTIFY_EVENTS                                                   \
+  (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_CLOSE_WRITE | FAN_RENAME | \
+   FAN_ONDIR)
+// Directories outside the source remembered so their events are dropped
+// without resolving the handle again.
+#define FAN_OUTSIDE_SLOTS 256
+#define WATCH_MAP_INIT_CAP 64
+#define COPY_QUEUE_LEN 1024
+#define DEFAULT_COPY_THREADS 4
+// How far past the oldest queued replication a worker looks for work that
+// doesn't wait on an earlier item, and the backlog worth logging.
+#define WORK_LOOKAHEAD 64
+#define WORK_REPORT_DEPTH 1024
+#define MAX_COPY_THREADS 64
+#define MAX_PENDING_MOVES 64
+#define MOVE_PAIR_TIMEOUT_MS 500
+#define DEFAULT_QUIET_MS 1000
+#define DIRTY_MAX_WAIT_FACTOR 10
+#define DIRTY_SET_INIT_CAP 64
+#define MAX_DESTINATIONS 16
+#define SHARED_BUF_SIZE (1024 * 1024)
+#define DEFAULT_LOOP_COPIERS 4
+#define MANIFEST_NAME ".sop-backup.manifest"
+#define MANIFEST_MAGIC "SOPMAN2"
+#define MANIFEST_INIT_CAP 1024
+#define HASH_BUF_SIZE (256 * 1024)
+#define SIGNATURE_DIR ".sop-backup.sigs"
+#define SIGNATURE_MAGIC "SOPSIG1"
+// Copies are linked under this prefix before being renamed into place.
+#define TEMP_PREFIX ".sop-backup.tmp."
+// Markers the sync command creates in the root of a source.
+#define SYNC_PREFIX ".sop-backup.sync."
+#define DEFAULT_SYNC_TIMEOUT_S 30
+#define SYNC_POLL_MS 10
+// Latencies are counted in 16 linear steps per power of two nanoseconds.
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS ((64 - 3) * LATENCY_SUB_BUCKETS)
+#define MAX_TRACE_ENTRIES (1 << 24)
+#define TRACE_MAGIC "SOPTRACE"
+#define TRASH_DIR ".sop-backup.trash"
+#define DELTA_BLOCK_SIZE (64 * 1024)
+#define DEFAULT_DELTA_THRESHOLD_MIB 64
+#define TAIL_CHECK_SIZE 4096
+#define LINK_MAP_INIT_CAP 64
+#define DIRENT_BUF_SIZE (32 * 1024)
+#define RESCAN_POLL_MS 100
+#define DEFAULT_POLL_MS 5000
+#define DEFAULT_COMMIT_WINDOW_MS 1000
+#define DEFAULT_COMMIT_WINDOW_MIB 64
 
 struct Watch {
   int wd;
   char *path;
 };
 
+// Open-addressing hash table keyed by wd with linear probing. A slot is free
+// when its path is NULL, so a zeroed WatchMap is a valid empty map.
 struct WatchMap {
-  struct Watch watch_map[MAX_WATCHES];
+  struct Watch *watch_map;
+  int capacity;
   int watch_count;
 };
 
-pid_t pids[MAX_JOBS];
-char pid_srcs[MAX_JOBS][PATH_MAX];
-char pid_dsts[MAX_JOBS][PATH_MAX];
+// Directories, with everything below them, that did not fit into the
+// inotify watch budget and are scanned periodically instead.
+struct PollList {
+  char **paths;
+  int count;
+  int capacity;
+};
+
+enum CopyMethod {
+  COPY_REFLINK,
+  COPY_RANGE,
+  COPY_SENDFILE,
+  COPY_BUFFERED,
+  COPY_SHARED,
+  COPY_DELTA,
+  COPY_TAIL,
+  COPY_SPARSE,
+  COPY_METHOD_COUNT
+};
+
+const char *copy_method_names[COPY_METHOD_COUNT] = {
+    "reflink", "copy_file_range", "sendfile", "buffered",
+    "shared buffer", "delta", "tail", "sparse"};
+
+struct CopyStats {
+  atomic_ulong files;
+  atomic_ullong bytes;
+  atomic_ullong nsec;
+};
+
+struct CopyStats copy_stats[COPY_METHOD_COUNT];
+atomic_int copy_method_disabled[COPY_METHOD_COUNT];
+
+// How replicated files are made durable. Off leaves it to the kernel;
+// the other modes commit whatever was written within a time or byte
+// window together, with one syncfs() per destination filesystem or with
+// sync_file_range() per file and one fsync() per directory.
+enum Durability { DURABILITY_OFF, DURABILITY_SYNCFS, DURABILITY_FSYNC };
+
+struct JobOptions {
+  int threads;
+  int quiet_ms;
+  int hash_files;
+  long long delta_threshold;
+  int poll_ms;
+  int inotify_only;
+  enum Durability durability;
+  int commit_ms;
+  long long commit_bytes;
+  long long rate_bytes;
+  long long rate_ops;
+  int trace_entries;
+};
+
+// On-disk manifest kept in the root of every destination. It maps the
+// relative path of each replicated entry (by its 64-bit hash) to the
+// source metadata it was copied from, so a restarted job can tell which
+// files are already in the backup. The file is an open-addressing table
+// mmap'd in full.
+struct ManifestHeader {
+  char magic[8];
+  uint64_t capacity;
+  uint64_t count;
+  uint32_t generation;
+  uint32_t reserved[9];
+};
+
+enum ManifestKind { MANIFEST_FILE = 1, MANIFEST_DIR = 2 };
+
+struct ManifestEntry {
+  uint64_t key;
+  uint64_t size;
+  uint64_t ino;
+  uint64_t hash;
+  uint64_t tail_hash;
+  int64_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint16_t kind;
+  uint16_t generation;
+};
+
+struct Manifest {
+  int fd;
+  int hash_files;
+  pthread_mutex_t lock;
+  size_t map_size;
+  struct ManifestHeader *header;
+  struct ManifestEntry *entries;
+  // Set when the table could not be resized. The old table stays mapped
+  // for whoever still holds the manifest, but nothing is looked up in it
+  // or recorded anymore.
+  int broken;
+};
+
+// One backup target of a job. A destination added to a running job is
+// synced by its own thread, with the copy threads of the add, while the
+// job keeps replicating events into it. The two are not ordered: when a
+// file changes while the sync copies it, the sync may publish its older
+// copy after the step for the change, and the backup of that file stays
+// behind until it changes again or a rescan finds it.
+struct Destination {
+  char *path;
+  const char *src;
+  int threads;
+  long long delta_threshold;
+  // Dropped, and kept in dropped_manifest until the destination is freed,
+  // once it can not grow; the destination then compares files in full.
+  _Atomic(struct Manifest *) manifest;
+  struct Manifest *dropped_manifest;
+  struct Committer *committer;
+  struct JobStatus *status;
+  pthread_t sync_thread;
+  int joinable;
+  atomic_int syncing;
+  // Directories removed from the backup are renamed into the trash and
+  // deleted there by a thread of their own, or in the event loop by the
+  // thread shared_trash runs for every destination.
+  int trash_fd;
+  pthread_t trash_thread;
+  int trash_started;
+  pthread_mutex_t trash_lock;
+  pthread_cond_t trash_cond;
+  int trash_pending;
+  atomic_int trash_stop;
+  int trash_shared;
+  int trash_queued;
+  struct Destination *trash_next;
+};
+
+// Paths in tasks are relative to src_root and every destination, starting
+// with '/' (or empty for the roots themselves). dst_mask selects the
+// destinations of the queue that still need the file.
+struct CopyTask {
+  char *rel;
+  mode_t mode;
+  unsigned int dst_mask;
+};
+
+struct CopyQueue {
+  const char *src_root;
+  struct Destination **dsts;
+  int dst_count;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct CopyTask tasks[COPY_QUEUE_LEN];
+  int head;
+  int count;
+  int closed;
+};
+
+// A byte rate and I/O rate limit as a token bucket that may run into
+// debt: every write is charged after it is done and the writer sleeps
+// until the bucket is back at zero. Buckets live in memory shared with the
+// parent, which changes the rates at any time, so the lock is
+// process-shared and survives a job killed while holding it.
+struct RateLimit {
+  // 0 is unlimited.
+  atomic_llong bytes_per_sec;
+  atomic_llong ops_per_sec;
+  pthread_mutex_t lock;
+  double byte_tokens;
+  double op_tokens;
+  struct timespec refilled;
+  atomic_ullong throttled_ns;
+};
+
+// What a job reports to the parent. It is mapped shared before the fork,
+// so the child writes it and list reads it without any round trip.
+// Replication steps are numbered as the events are read; each sequence
+// number says every step up to it is done.
+struct JobStatus {
+  // The program that started the job, whose sync markers it answers.
+  pid_t owner;
+  enum Durability durability;
+  atomic_ullong queued_seq;
+  atomic_ullong replicated_seq;
+  atomic_ullong durable_seq;
+  struct RateLimit limit;
+  // Counters only the job writes, read by stats without locks.
+  atomic_ullong events;
+  atomic_ullong bytes_written;
+  atomic_ullong files_replicated;
+  atomic_ullong errors;
+  atomic_int pending_steps;
+  atomic_int dirty_files;
+  // When the event of the oldest unfinished step was read, 0 when caught
+  // up.
+  atomic_ullong oldest_event_ns;
+  atomic_int fanotify;
+  atomic_int watches;
+  atomic_int polled;
+  // Destinations still copying the whole tree, and whether a rescan
+  // waits to start.
+  atomic_int catching_up;
+  atomic_int rescan_pending;
+  // The last sync marker read and the step that finishes it.
+  atomic_ullong sync_marker;
+  atomic_ullong sync_seq;
+  // How long replication steps took from reading their event to done.
+  atomic_ullong latency[LATENCY_BUCKETS];
+};
+
+// One replication step in the trace. The times are CLOCK_MONOTONIC.
+struct TraceRecord {
+  uint64_t read_ns;
+  uint64_t done_ns;
+  uint64_t seq;
+  uint32_t op;
+  uint32_t path_hash;
+};
+
+// What a trace dump starts with, followed by count records, oldest first.
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t count;
+};
+
+// The last capacity steps of a job, kept only when tracing was asked for.
+struct Trace {
+  atomic_ullong next;
+  unsigned int capacity;
+  struct TraceRecord records[];
+};
+
+// A watched source as seen by the parent. In process mode ctl_fd is the
+// write end of the pipe the job reads destination changes from; in
+// event-loop mode the job is the in-process monitor instead.
+struct Job {
+  pid_t pid;
+  int ctl_fd;
+  struct Monitor *monitor;
+  struct JobStatus *status;
+  // Counters at the previous stats, for the rates since then.
+  unsigned long long seen_events;
+  unsigned long long seen_bytes;
+  struct timespec seen_at;
+  char src[PATH_MAX];
+  int dst_count;
+  char *dsts[MAX_DESTINATIONS];
+};
+
+struct ControlMessage {
+  char op;
+  // For 'A': the copy threads of the add that brought the destination.
+  int threads;
+  char path[PATH_MAX];
+};
+
+struct Job jobs[MAX_JOBS];
 
 char *args[MAX_ARGS];
 int arg_count = 0;
 volatile int keep_running = 1;
 volatile int main_keep_running = 1;
+volatile int dump_trace = 0;
 
 void sethandler(void (*f)(int), int sigNo) {
   struct sigaction act;
@@ -58,6 +375,8 @@ void main_handler(int sig) { main_keep_running = 0; }
 
 void sigterm_handler(int sig) { keep_running = 0; }
 
+void trace_handler(int sig) { dump_trace = 1; }
+
 ssize_t bulk_read(int fd, char *buf, size_t count) {
   ssize_t c;
   ssize_t len = 0;
@@ -120,41 +439,563 @@ int is_dir_empty(const char *path) {
   return empty;
 }
 
-void add_to_map(struct WatchMap *map, int wd, const char *path) {
-  if (map->watch_count >= MAX_WATCHES) {
-    fprintf(stderr, "Too many watches\n");
+// Reads a directory in large getdents64 batches instead of one readdir
+// call at a time. Owns fd from dir_open on.
+struct DirReader {
+  int fd;
+  int pos;
+  int len;
+  char *buf;
+};
+
+int open_dir_at(int dir_fd, const char *name) {
+  return TEMP_FAILURE_RETRY(
+      openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+}
+
+void dir_open(struct DirReader *dir, int fd) {
+  dir->fd = fd;
+  dir->pos = 0;
+  dir->len = 0;
+  dir->buf = malloc(DIRENT_BUF_SIZE);
+  if (dir->buf == NULL) {
+    ERR("malloc");
+  }
+}
+
+// Returns the next entry other than "." and "..", or NULL at the end.
+struct dirent64 *dir_next(struct DirReader *dir) {
+  for (;;) {
+    if (dir->pos >= dir->len) {
+      ssize_t len = getdents64(dir->fd, dir->buf, DIRENT_BUF_SIZE);
+      if (len <= 0) {
+        if (len < 0) {
+          perror("getdents64");
+        }
+        return NULL;
+      }
+      dir->len = len;
+      dir->pos = 0;
+    }
+
+    struct dirent64 *entry = (struct dirent64 *)(dir->buf + dir->pos);
+    dir->pos += entry->d_reclen;
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      return entry;
+    }
+  }
+}
+
+void dir_close(struct DirReader *dir) {
+  free(dir->buf);
+  TEMP_FAILURE_RETRY(close(dir->fd));
+}
+
+// The DT_* type of an entry of dir_fd, asking the inode only when the
+// filesystem does not fill in d_type.
+int dir_entry_type(int dir_fd, const struct dirent64 *entry) {
+  struct stat st;
+  if (entry->d_type != DT_UNKNOWN) {
+    return entry->d_type;
+  }
+  if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    return DT_UNKNOWN;
+  }
+  return IFTODT(st.st_mode);
+}
+
+// Removes name in dir_fd whatever its type. Directories are emptied
+// through their own fd, so no path is ever resolved twice. Gives up
+// half-way once *stop is set.
+int remove_at_until(int dir_fd, const char *name, atomic_int *stop) {
+  if (unlinkat(dir_fd, name, 0) == 0) {
+    return 0;
+  }
+  if (errno != EISDIR) {
+    return -1;
+  }
+
+  int fd = open_dir_at(dir_fd, name);
+  if (fd < 0) {
+    perror("openat");
+    return -1;
+  }
+
+  struct DirReader dir;
+  struct dirent64 *entry;
+  dir_open(&dir, fd);
+  while ((entry = dir_next(&dir)) != NULL) {
+    if (stop && atomic_load(stop)) {
+      break;
+    }
+    if (entry->d_type == DT_DIR) {
+      remove_at_until(fd, entry->d_name, stop);
+    } else if (unlinkat(fd, entry->d_name, 0) < 0 && errno == EISDIR) {
+      remove_at_until(fd, entry->d_name, stop);
+    }
+  }
+  dir_close(&dir);
+
+  return unlinkat(dir_fd, name, AT_REMOVEDIR);
+}
+
+int remove_at(int dir_fd, const char *name) {
+  return remove_at_until(dir_fd, name, NULL);
+}
+
+void timespec_add_ms(struct timespec *ts, long ms) {
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+long ms_until(const struct timespec *deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (deadline->tv_sec - now.tv_sec) * 1000L +
+         (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+}
+
+// Starts a helper thread with every signal blocked, so signals keep going
+// to the thread that handles them.
+int create_quiet_thread(pthread_t *thread, void *(*work)(void *), void *arg) {
+  sigset_t mask, old_mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+  int res = pthread_create(thread, NULL, work, arg);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  return res;
+}
+
+atomic_uint trash_counter;
+
+// The destinations of the event loop with something in their trash, in
+// the order they got it.
+struct TrashQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct Destination *head;
+  struct Destination *tail;
+  // The destination being emptied, which stop_trash waits out.
+  struct Destination *current;
+  int stop;
+  pthread_t thread;
+};
+
+struct TrashQueue *shared_trash = NULL;
+
+void queue_trash(struct Destination *dst) {
+  pthread_mutex_lock(&shared_trash->lock);
+  if (!dst->trash_queued && !atomic_load(&dst->trash_stop)) {
+    dst->trash_queued = 1;
+    dst->trash_next = NULL;
+    if (shared_trash->tail) {
+      shared_trash->tail->trash_next = dst;
+    } else {
+      shared_trash->head = dst;
+    }
+    shared_trash->tail = dst;
+    pthread_cond_signal(&shared_trash->changed);
+  }
+  pthread_mutex_unlock(&shared_trash->lock);
+}
+
+// Removes name in dir_fd, a part of the backup dst. A directory is only
+// renamed into the trash, which takes the same time whatever it holds,
+// and left to the trash thread. Anything else is unlinked right away.
+int trash_at(struct Destination *dst, int dir_fd, const char *name) {
+  if (unlinkat(dir_fd, name, 0) == 0) {
+    return 0;
+  }
+  if (errno != EISDIR || dst->trash_fd < 0) {
+    return errno == EISDIR ? remove_at(dir_fd, name) : -1;
+  }
+
+  char trash_name[64];
+  snprintf(trash_name, sizeof(trash_name), "%ld.%d.%u", (long)time(NULL),
+           getpid(), atomic_fetch_add(&trash_counter, 1));
+  if (renameat(dir_fd, name, dst->trash_fd, trash_name) < 0) {
+    return remove_at(dir_fd, name);
+  }
+
+  if (dst->trash_shared) {
+    queue_trash(dst);
+    return 0;
+  }
+  pthread_mutex_lock(&dst->trash_lock);
+  dst->trash_pending = 1;
+  pthread_cond_signal(&dst->trash_cond);
+  pthread_mutex_unlock(&dst->trash_lock);
+  return 0;
+}
+
+// Deleting is never urgent, so trash threads run at the lowest CPU and
+// I/O priority.
+void lower_trash_priority() {
+  setpriority(PRIO_PROCESS, gettid(), 19);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, gettid(),
+          IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+}
+
+// Deletes what the trash of dst holds, unless it is stopped first.
+void empty_trash_once(struct Destination *dst) {
+  int fd = open_dir_at(dst->trash_fd, ".");
+  if (fd < 0) {
     return;
   }
-  map->watch_map[map->watch_count].wd = wd;
-  map->watch_map[map->watch_count].path = strdup(path);
-  map->watch_count++;
+  struct DirReader dir;
+  struct dirent64 *entry;
+  dir_open(&dir, fd);
+  while ((entry = dir_next(&dir)) != NULL && !atomic_load(&dst->trash_stop)) {
+    remove_at_until(fd, entry->d_name, &dst->trash_stop);
+  }
+  dir_close(&dir);
+}
+
+// Empties the trash of a destination, starting with whatever an earlier
+// run left in it, then waits for more.
+void *empty_trash(void *arg) {
+  struct Destination *dst = arg;
+
+  lower_trash_priority();
+  pthread_mutex_lock(&dst->trash_lock);
+  while (!atomic_load(&dst->trash_stop)) {
+    dst->trash_pending = 0;
+    pthread_mutex_unlock(&dst->trash_lock);
+
+    empty_trash_once(dst);
+
+    pthread_mutex_lock(&dst->trash_lock);
+    while (!dst->trash_pending && !atomic_load(&dst->trash_stop)) {
+      pthread_cond_wait(&dst->trash_cond, &dst->trash_lock);
+    }
+  }
+  pthread_mutex_unlock(&dst->trash_lock);
+  return NULL;
+}
+
+// Empties the trash of one queued destination after the other.
+void *empty_shared_trash(void *arg) {
+  lower_trash_priority();
+  pthread_mutex_lock(&shared_trash->lock);
+  for (;;) {
+    while (shared_trash->head == NULL && !shared_trash->stop) {
+      pthread_cond_wait(&shared_trash->changed, &shared_trash->lock);
+    }
+    struct Destination *dst = shared_trash->head;
+    if (dst == NULL) {
+      break;
+    }
+    shared_trash->head = dst->trash_next;
+    if (shared_trash->head == NULL) {
+      shared_trash->tail = NULL;
+    }
+    dst->trash_queued = 0;
+    shared_trash->current = dst;
+    pthread_mutex_unlock(&shared_trash->lock);
+
+    empty_trash_once(dst);
+
+    pthread_mutex_lock(&shared_trash->lock);
+    shared_trash->current = NULL;
+    pthread_cond_broadcast(&shared_trash->changed);
+  }
+  pthread_mutex_unlock(&shared_trash->lock);
+  return NULL;
+}
+
+void start_shared_trash() {
+  shared_trash = calloc(1, sizeof(struct TrashQueue));
+  if (shared_trash == NULL) {
+    ERR("calloc");
+  }
+  pthread_mutex_init(&shared_trash->lock, NULL);
+  pthread_cond_init(&shared_trash->changed, NULL);
+  if (create_quiet_thread(&shared_trash->thread, empty_shared_trash,
+                          NULL) != 0) {
+    ERR("pthread_create");
+  }
+}
+
+// Called once every destination has stopped its trash.
+void stop_shared_trash() {
+  pthread_mutex_lock(&shared_trash->lock);
+  shared_trash->stop = 1;
+  pthread_cond_broadcast(&shared_trash->changed);
+  pthread_mutex_unlock(&shared_trash->lock);
+  pthread_join(shared_trash->thread, NULL);
+
+  pthread_mutex_destroy(&shared_trash->lock);
+  pthread_cond_destroy(&shared_trash->changed);
+  free(shared_trash);
+  shared_trash = NULL;
+}
+
+void start_trash(struct Destination *dst) {
+  char path[PATH_MAX];
+
+  pthread_mutex_init(&dst->trash_lock, NULL);
+  pthread_cond_init(&dst->trash_cond, NULL);
+  snprintf(path, sizeof(path), "%s/%s", dst->path, TRASH_DIR);
+  if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST) {
+    perror("mkdir trash");
+  }
+  dst->trash_fd = open_dir_at(AT_FDCWD, path);
+  if (dst->trash_fd < 0) {
+    return;
+  }
+  if (shared_trash) {
+    dst->trash_shared = 1;
+    queue_trash(dst);
+    return;
+  }
+  dst->trash_started =
+      create_quiet_thread(&dst->trash_thread, empty_trash, dst) == 0;
+}
+
+// Takes dst off the shared trash queue, waiting while it is emptied.
+void unqueue_trash(struct Destination *dst) {
+  pthread_mutex_lock(&shared_trash->lock);
+  atomic_store(&dst->trash_stop, 1);
+  struct Destination **link = &shared_trash->head;
+  struct Destination *prev = NULL;
+  while (dst->trash_queued && *link != dst) {
+    prev = *link;
+    link = &(*link)->trash_next;
+  }
+  if (dst->trash_queued) {
+    *link = dst->trash_next;
+    if (shared_trash->tail == dst) {
+      shared_trash->tail = prev;
+    }
+    dst->trash_queued = 0;
+  }
+  while (shared_trash->current == dst) {
+    pthread_cond_wait(&shared_trash->changed, &shared_trash->lock);
+  }
+  pthread_mutex_unlock(&shared_trash->lock);
+}
+
+// Stops the trash thread where it is; the next run picks up the rest.
+void stop_trash(struct Destination *dst) {
+  pthread_mutex_lock(&dst->trash_lock);
+  atomic_store(&dst->trash_stop, 1);
+  pthread_cond_signal(&dst->trash_cond);
+  pthread_mutex_unlock(&dst->trash_lock);
+
+  if (dst->trash_shared) {
+    unqueue_trash(dst);
+  }
+
+  if (dst->trash_started) {
+    pthread_join(dst->trash_thread, NULL);
+  }
+  if (dst->trash_fd >= 0) {
+    TEMP_FAILURE_RETRY(close(dst->trash_fd));
+  }
+  pthread_mutex_destroy(&dst->trash_lock);
+  pthread_cond_destroy(&dst->trash_cond);
+}
+
+unsigned int watch_slot(const struct WatchMap *map, int wd) {
+  return ((unsigned int)wd * 2654435761u) & (map->capacity - 1);
+}
+
+void grow_map(struct WatchMap *map) {
+  struct Watch *old = map->watch_map;
+  int old_capacity = map->capacity;
+
+  map->capacity = old_capacity ? old_capacity * 2 : WATCH_MAP_INIT_CAP;
+  map->watch_map = calloc(map->capacity, sizeof(struct Watch));
+  if (map->watch_map == NULL) {
+    ERR("calloc");
+  }
+
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].path == NULL) {
+      continue;
+    }
+    unsigned int slot = watch_slot(map, old[i].wd);
+    while (map->watch_map[slot].path != NULL) {
+      slot = (slot + 1) & (map->capacity - 1);
+    }
+    map->watch_map[slot] = old[i];
+  }
+  free(old);
 }
 
 struct Watch *find_watch(struct WatchMap *map, int wd) {
-  for (int i = 0; i < map->watch_count; i++) {
-    if (map->watch_map[i].wd == wd) {
-      return &map->watch_map[i];
+  if (map->capacity == 0) {
+    return NULL;
+  }
+
+  unsigned int slot = watch_slot(map, wd);
+  while (map->watch_map[slot].path != NULL) {
+    if (map->watch_map[slot].wd == wd) {
+      return &map->watch_map[slot];
     }
+    slot = (slot + 1) & (map->capacity - 1);
   }
   return NULL;
 }
 
+void add_to_map(struct WatchMap *map, int wd, const char *path) {
+  // inotify hands out the same wd when a directory is watched again.
+  struct Watch *watch = find_watch(map, wd);
+  if (watch) {
+    free(watch->path);
+    watch->path = strdup(path);
+    return;
+  }
+
+  if ((map->watch_count + 1) * 4 > map->capacity * 3) {
+    grow_map(map);
+  }
+
+  unsigned int slot = watch_slot(map, wd);
+  while (map->watch_map[slot].path != NULL) {
+    slot = (slot + 1) & (map->capacity - 1);
+  }
+  map->watch_map[slot].wd = wd;
+  map->watch_map[slot].path = strdup(path);
+  map->watch_count++;
+}
+
 void remove_from_map(struct WatchMap *map, int wd) {
-  for (int i = 0; i < map->watch_count; i++) {
-    if (map->watch_map[i].wd == wd) {
-      free(map->watch_map[i].path);
-      map->watch_map[i] = map->watch_map[map->watch_count - 1];
-      map->watch_count--;
+  struct Watch *watch = find_watch(map, wd);
+  if (watch == NULL) {
+    return;
+  }
+
+  unsigned int mask = map->capacity - 1;
+  unsigned int hole = watch - map->watch_map;
+  free(watch->path);
+  watch->path = NULL;
+  map->watch_count--;
+
+  // Backward-shift the rest of the probe chain so lookups never need
+  // tombstones.
+  unsigned int slot = (hole + 1) & mask;
+  while (map->watch_map[slot].path != NULL) {
+    unsigned int home = watch_slot(map, map->watch_map[slot].wd);
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      map->watch_map[hole] = map->watch_map[slot];
+      map->watch_map[slot].path = NULL;
+      hole = slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
+void free_map(struct WatchMap *map) {
+  for (int i = 0; i < map->capacity; i++) {
+    free(map->watch_map[i].path);
+  }
+  free(map->watch_map);
+  memset(map, 0, sizeof(*map));
+}
+
+int path_under(const char *path, const char *dir) {
+  size_t len = strlen(dir);
+  return strncmp(path, dir, len) == 0 &&
+         (path[len] == '/' || path[len] == '\0');
+}
+
+int path_depth(const char *path) {
+  int depth = 0;
+  for (; *path; path++) {
+    depth += *path == '/';
+  }
+  return depth;
+}
+
+// Removes the watches of path and of every watched directory below it.
+void unwatch_under(int notify_fd, struct WatchMap *map, const char *path) {
+  int *wds = malloc((map->watch_count ? map->watch_count : 1) * sizeof(int));
+  int count = 0;
+
+  if (wds == NULL) {
+    ERR("malloc");
+  }
+
+  for (int i = 0; i < map->capacity; i++) {
+    const char *watched = map->watch_map[i].path;
+    if (watched && path_under(watched, path)) {
+      wds[count++] = map->watch_map[i].wd;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    inotify_rm_watch(notify_fd, wds[i]);
+    remove_from_map(map, wds[i]);
+  }
+  free(wds);
+}
+
+void remove_polled(struct PollList *list, int idx) {
+  free(list->paths[idx]);
+  list->paths[idx] = list->paths[--list->count];
+}
+
+void remove_polled_under(struct PollList *list, const char *path) {
+  for (int i = list->count - 1; i >= 0; i--) {
+    if (path_under(list->paths[i], path)) {
+      remove_polled(list, i);
+    }
+  }
+}
+
+void add_polled(struct PollList *list, const char *path) {
+  for (int i = 0; i < list->count; i++) {
+    if (path_under(path, list->paths[i])) {
       return;
     }
   }
+  remove_polled_under(list, path);
+
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 16;
+    list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+    if (list->paths == NULL) {
+      ERR("realloc");
+    }
+  }
+  list->paths[list->count++] = strdup(path);
+}
+
+void rename_polled(struct PollList *list, const char *old_path,
+                   const char *new_path) {
+  size_t old_len = strlen(old_path);
+  for (int i = 0; i < list->count; i++) {
+    if (path_under(list->paths[i], old_path)) {
+      char renamed[PATH_MAX];
+      snprintf(renamed, sizeof(renamed), "%s%s", new_path,
+               list->paths[i] + old_len);
+      free(list->paths[i]);
+      list->paths[i] = strdup(renamed);
+    }
+  }
+}
+
+void free_polled(struct PollList *list) {
+  for (int i = 0; i < list->count; i++) {
+    free(list->paths[i]);
+  }
+  free(list->paths);
+  memset(list, 0, sizeof(*list));
 }
 
 void update_watch_paths(struct WatchMap *map, const char *old_path,
                         const char *new_path) {
   size_t old_len = strlen(old_path);
 
-  for (int i = 0; i < map->watch_count; i++) {
+  for (int i = 0; i < map->capacity; i++) {
+    if (map->watch_map[i].path == NULL) {
+      continue;
+    }
     if (strncmp(map->watch_map[i].path, old_path, old_len) == 0 &&
         (map->watch_map[i].path[old_len] == '/' ||
          map->watch_map[i].path[old_len] == '\0')) {
@@ -167,402 +1008,4756 @@ void update_watch_paths(struct WatchMap *map, const char *old_path,
   }
 }
 
-void add_watch_recursive(int notify_fd, struct WatchMap *map,
-                         const char *base_path) {
-  uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM |
-                  IN_MOVED_TO | IN_DELETE_SELF;
-  int wd = inotify_add_watch(notify_fd, base_path, mask);
+// Watches path. When the watch budget is exhausted and polled is given,
+// the deepest watched subtree below the depth of path is handed over to
+// polling to make room, if evict allows it, or path itself is polled.
+int watch_dir(int notify_fd, struct WatchMap *map, struct PollList *polled,
+              int evict, const char *path) {
+  uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+                  IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF;
+  int wd = inotify_add_watch(notify_fd, path, mask);
+
+  if (wd < 0 && errno == ENOSPC && polled && evict) {
+    const char *deepest = NULL;
+    int depth = path_depth(path);
+    for (int i = 0; i < map->capacity; i++) {
+      const char *watched = map->watch_map[i].path;
+      if (watched && path_depth(watched) > depth) {
+        depth = path_depth(watched);
+        deepest = watched;
+      }
+    }
+
+    if (deepest) {
+      char victim[PATH_MAX];
+      snprintf(victim, sizeof(victim), "%s", deepest);
+      unwatch_under(notify_fd, map, victim);
+      add_polled(polled, victim);
+      wd = inotify_add_watch(notify_fd, path, mask);
+    }
+  }
 
   if (wd < 0) {
-    perror("inotify_add_watch");
-    return;
+    if (errno == ENOSPC && polled) {
+      add_polled(polled, path);
+    } else {
+      perror("inotify_add_watch");
+    }
+    return -1;
   }
 
-  add_to_map(map, wd, base_path);
+  add_to_map(map, wd, path);
+  return wd;
+}
+
+// Returns the watch descriptor of base_path or -1. When lock is given,
+// map and polled are only touched while holding it, one directory at a
+// time, so the thread owning them keeps going during a long walk.
+int add_watch_recursive(int notify_fd, struct WatchMap *map,
+                        struct PollList *polled, int evict,
+                        const char *base_path, pthread_mutex_t *lock) {
+  if (lock) {
+    pthread_mutex_lock(lock);
+  }
+  int wd = watch_dir(notify_fd, map, polled, evict, base_path);
+  if (lock) {
+    pthread_mutex_unlock(lock);
+  }
 
-  DIR *dir = opendir(base_path);
+  if (wd < 0) {
+    return -1;
+  }
 
-  if (!dir) {
+  int fd = open_dir_at(AT_FDCWD, base_path);
+  if (fd < 0) {
     perror("opendir");
-    return;
+    return wd;
   }
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+  // inotify wants paths, but d_type spares a stat per entry.
+  struct DirReader dir;
+  struct dirent64 *entry;
+  dir_open(&dir, fd);
+  while ((entry = dir_next(&dir)) != NULL) {
+    if (dir_entry_type(fd, entry) != DT_DIR) {
       continue;
     }
 
     char full_path[PATH_MAX];
     snprintf(full_path, sizeof(full_path), "%s/%s", base_path, entry->d_name);
+    add_watch_recursive(notify_fd, map, polled, evict, full_path, lock);
+  }
+  dir_close(&dir);
+  return wd;
+}
 
-    struct stat st;
-    if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode)) {
-      add_watch_recursive(notify_fd, map, full_path);
+unsigned long long monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+unsigned long long elapsed_ns(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec -
+         start->tv_nsec;
+}
+
+// The limit of all jobs together, shared by the parent with every job.
+struct RateLimit *global_limit;
+// The job the thread is copying for, while it copies.
+_Thread_local struct JobStatus *copy_job;
+
+void rate_limit_init(struct RateLimit *limit, long long bytes_per_sec,
+                     long long ops_per_sec) {
+  memset(limit, 0, sizeof(*limit));
+  atomic_init(&limit->bytes_per_sec, bytes_per_sec);
+  atomic_init(&limit->ops_per_sec, ops_per_sec);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&limit->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+int rate_limited(const struct RateLimit *limit) {
+  return limit && (atomic_load(&limit->bytes_per_sec) > 0 ||
+                   atomic_load(&limit->ops_per_sec) > 0);
+}
+
+// Takes bytes and ops from the bucket and sleeps off any debt.
+void charge_limit(struct RateLimit *limit, long long bytes, long long ops) {
+  long long byte_rate = atomic_load(&limit->bytes_per_sec);
+  long long op_rate = atomic_load(&limit->ops_per_sec);
+  if (byte_rate <= 0 && op_rate <= 0) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (pthread_mutex_lock(&limit->lock) == EOWNERDEAD) {
+    pthread_mutex_consistent(&limit->lock);
+  }
+  double secs = (now.tv_sec - limit->refilled.tv_sec) +
+                (now.tv_nsec - limit->refilled.tv_nsec) / 1e9;
+  limit->refilled = now;
+
+  // A full bucket holds one second worth of I/O.
+  double wait = 0;
+  limit->byte_tokens += secs * byte_rate;
+  if (limit->byte_tokens > byte_rate) {
+    limit->byte_tokens = byte_rate;
+  }
+  if (byte_rate > 0) {
+    limit->byte_tokens -= bytes;
+    if (limit->byte_tokens < 0) {
+      wait = -limit->byte_tokens / byte_rate;
+    }
+  }
+  limit->op_tokens += secs * op_rate;
+  if (limit->op_tokens > op_rate) {
+    limit->op_tokens = op_rate;
+  }
+  if (op_rate > 0) {
+    limit->op_tokens -= ops;
+    if (limit->op_tokens < 0 && -limit->op_tokens / op_rate > wait) {
+      wait = -limit->op_tokens / op_rate;
     }
   }
+  pthread_mutex_unlock(&limit->lock);
+
+  if (wait > 0) {
+    struct timespec pause = {.tv_sec = (time_t)wait,
+                             .tv_nsec = (wait - (time_t)wait) * 1e9};
+    nanosleep(&pause, NULL);
+    atomic_fetch_add_explicit(&limit->throttled_ns, elapsed_ns(&now),
+                              memory_order_relaxed);
+  }
+}
 
-  if (closedir(dir)) {
+// Counts a write of bytes in ops system calls for the job and charges it
+// to the limits that apply.
+void account_io(long long bytes, long long ops) {
+  if (copy_job) {
+    atomic_fetch_add_explicit(&copy_job->bytes_written, bytes,
+                              memory_order_relaxed);
+    charge_limit(&copy_job->limit, bytes, ops);
+  }
+  if (global_limit) {
+    charge_limit(global_limit, bytes, ops);
+  }
+}
+
+// How much one in-kernel copy call may move. Under a limit the chunks
+// shrink to a tenth of a second of I/O, so the sleeps stay short.
+size_t copy_chunk_size() {
+  long long rate = 0;
+  if (copy_job && rate_limited(&copy_job->limit)) {
+    rate = atomic_load(&copy_job->limit.bytes_per_sec);
+  }
+  if (rate_limited(global_limit)) {
+    long long global = atomic_load(&global_limit->bytes_per_sec);
+    if (global > 0 && (rate <= 0 || global < rate)) {
+      rate = global;
+    }
+  }
+  if (rate <= 0 || rate / 10 >= COPY_CHUNK_SIZE) {
+    return COPY_CHUNK_SIZE;
+  }
+  return rate / 10 > COPY_BUF_SIZE ? rate / 10 : COPY_BUF_SIZE;
+}
+
+// Errors after which the next copy method is worth trying: the kernel or
+// one of the filesystems simply does not support this way of copying.
+int copy_can_fall_back(int err) {
+  return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+         err == ENOTTY;
+}
+
+// Copies from the current offset of f_src to the current offset of f_dst
+// until EOF. Returns 0 on success, -1 with errno set otherwise. Both offsets
+// are advanced, so after a failure the next method continues from there.
+int copy_fd_kernel(int f_src, int f_dst, enum CopyMethod method,
+                   unsigned long long *copied) {
+  for (;;) {
+    size_t chunk = copy_chunk_size();
+    ssize_t c;
+    if (method == COPY_RANGE) {
+      c = copy_file_range(f_src, NULL, f_dst, NULL, chunk, 0);
+    } else {
+      c = sendfile(f_dst, f_src, NULL, chunk);
+    }
+
+    if (c < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (c == 0) {
+      return 0;
+    }
+    *copied += c;
+    account_io(c, 1);
+  }
+}
+
+int copy_fd_buffered(int f_src, int f_dst, unsigned long long *copied) {
+  char buf[COPY_BUF_SIZE];
+  ssize_t bytes_read;
+
+  while ((bytes_read = bulk_read(f_src, buf, sizeof(buf))) > 0) {
+    if (bulk_write(f_dst, buf, bytes_read) != bytes_read) {
+      perror("bulk_write\n");
+      return -1;
+    }
+    *copied += bytes_read;
+    account_io(bytes_read, 1);
+  }
+  return bytes_read < 0 ? -1 : 0;
+}
+
+void record_copy(enum CopyMethod method, unsigned long long bytes,
+                 const struct timespec *start) {
+  atomic_fetch_add_explicit(&copy_stats[method].files, 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&copy_stats[method].bytes, bytes,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&copy_stats[method].nsec, elapsed_ns(start),
+                            memory_order_relaxed);
+}
+
+int copy_fd_reflink(int f_src, int f_dst) {
+  struct timespec start;
+  struct stat st;
+
+  if (copy_method_disabled[COPY_REFLINK]) {
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (ioctl(f_dst, FICLONE, f_src) < 0) {
+    if (errno == ENOSYS) {
+      copy_method_disabled[COPY_REFLINK] = 1;
+    }
+    return -1;
+  }
+
+  record_copy(COPY_REFLINK, fstat(f_dst, &st) == 0 ? st.st_size : 0, &start);
+  return 0;
+}
+
+// Copies the whole content of f_src into the empty f_dst, trying the
+// in-kernel paths from first on. Returns the method that finished the copy
+// or -1.
+int copy_fd(int f_src, int f_dst, enum CopyMethod first,
+            unsigned long long *copied) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  *copied = 0;
+
+  enum CopyMethod method = first;
+  int result = -1;
+
+  for (; method <= COPY_BUFFERED; method++) {
+    if (copy_method_disabled[method]) {
+      continue;
+    }
+
+    if (method == COPY_REFLINK) {
+      result = copy_fd_reflink(f_src, f_dst);
+      if (result == 0) {
+        return method;
+      }
+    } else if (method == COPY_BUFFERED) {
+      result = copy_fd_buffered(f_src, f_dst, copied);
+    } else {
+      result = copy_fd_kernel(f_src, f_dst, method, copied);
+    }
+
+    if (result == 0) {
+      break;
+    }
+
+    if (!copy_can_fall_back(errno)) {
+      perror(copy_method_names[method]);
+      return -1;
+    }
+
+    if (errno == ENOSYS) {
+      copy_method_disabled[method] = 1;
+    }
+  }
+
+  if (result < 0) {
+    return -1;
+  }
+
+  record_copy(method, *copied, &start);
+  return method;
+}
+
+// Reads f_src once and writes every chunk to all f_dsts. A destination
+// that fails is closed and set to -1 so the others still get the data.
+int copy_fds_shared(int f_src, int *f_dsts, int count) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  char *buf = malloc(SHARED_BUF_SIZE);
+  if (buf == NULL) {
+    ERR("malloc");
+  }
+
+  unsigned long long copied = 0;
+  ssize_t bytes_read;
+  int result = 0;
+
+  while ((bytes_read = bulk_read(f_src, buf, SHARED_BUF_SIZE)) > 0) {
+    int writes = 0;
+    for (int i = 0; i < count; i++) {
+      if (f_dsts[i] < 0) {
+        continue;
+      }
+      writes++;
+      if (bulk_write(f_dsts[i], buf, bytes_read) != bytes_read) {
+        perror("bulk_write\n");
+        TEMP_FAILURE_RETRY(close(f_dsts[i]));
+        f_dsts[i] = -1;
+        result = -1;
+      }
+    }
+    copied += bytes_read;
+    account_io(bytes_read * writes, writes);
+  }
+  if (bytes_read < 0) {
+    perror("read");
+    for (int i = 0; i < count; i++) {
+      if (f_dsts[i] >= 0) {
+        TEMP_FAILURE_RETRY(close(f_dsts[i]));
+        f_dsts[i] = -1;
+      }
+    }
+    result = -1;
+  }
+
+  free(buf);
+  for (int i = 0; i < count; i++) {
+    if (f_dsts[i] >= 0) {
+      record_copy(COPY_SHARED, copied, &start);
+    }
+  }
+  return result;
+}
+
+int is_sparse(const struct stat *st) {
+  return (long long)st->st_blocks * 512 < st->st_size;
+}
+
+int is_zero(const unsigned char *buf, size_t len) {
+  return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+int pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+  for (size_t done = 0; done < len;) {
+    ssize_t c = TEMP_FAILURE_RETRY(pwrite(fd, buf + done, len - done,
+                                          offset + done));
+    if (c < 0) {
+      return -1;
+    }
+    done += c;
+  }
+  return 0;
+}
+
+// Like copy_fds_shared, but only the data extents of f_src are read and
+// written, at their own offsets. The holes in between stay holes in the
+// fresh f_dsts, whose size is set at the end.
+int copy_fds_sparse(int f_src, int *f_dsts, int count, off_t size) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  char *buf = malloc(SHARED_BUF_SIZE);
+  if (buf == NULL) {
+    ERR("malloc");
+  }
+
+  unsigned long long copied = 0;
+  int result = 0;
+  int read_failed = 0;
+  off_t data = 0;
+
+  while (!read_failed && data < size &&
+         (data = lseek(f_src, data, SEEK_DATA)) >= 0) {
+    off_t hole = lseek(f_src, data, SEEK_HOLE);
+    if (hole < 0) {
+      perror("lseek");
+      read_failed = 1;
+      break;
+    }
+
+    while (data < hole) {
+      size_t want = hole - data < SHARED_BUF_SIZE ? hole - data
+                                                  : SHARED_BUF_SIZE;
+      ssize_t bytes_read = TEMP_FAILURE_RETRY(pread(f_src, buf, want, data));
+      if (bytes_read < 0) {
+        perror("pread");
+        read_failed = 1;
+        break;
+      }
+      if (bytes_read == 0) {
+        // The file shrank under us: the rest is zero-filled below.
+        hole = data;
+        break;
+      }
+      int writes = 0;
+      for (int i = 0; i < count; i++) {
+        if (f_dsts[i] < 0) {
+          continue;
+        }
+        writes++;
+        if (pwrite_all(f_dsts[i], buf, bytes_read, data)) {
+          perror("pwrite");
+          TEMP_FAILURE_RETRY(close(f_dsts[i]));
+          f_dsts[i] = -1;
+          result = -1;
+        }
+      }
+      data += bytes_read;
+      copied += bytes_read;
+      account_io(bytes_read * writes, writes);
+    }
+    data = hole;
+  }
+  // ENXIO only says there is no data left before the end of the file.
+  if (data < 0 && errno != ENXIO) {
+    perror("lseek");
+    read_failed = 1;
+  }
+
+  // A copy missing part of the source must not replace a good backup.
+  if (read_failed) {
+    for (int i = 0; i < count; i++) {
+      if (f_dsts[i] >= 0) {
+        TEMP_FAILURE_RETRY(close(f_dsts[i]));
+        f_dsts[i] = -1;
+      }
+    }
+    result = -1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (f_dsts[i] >= 0 && ftruncate(f_dsts[i], size) < 0) {
+      perror("ftruncate");
+      TEMP_FAILURE_RETRY(close(f_dsts[i]));
+      f_dsts[i] = -1;
+      result = -1;
+    }
+  }
+
+  free(buf);
+  for (int i = 0; i < count; i++) {
+    if (f_dsts[i] >= 0) {
+      record_copy(COPY_SPARSE, copied, &start);
+    }
+  }
+  return result;
+}
+
+void print_copy_stats(const char *what, const char *src) {
+  printf("[%d] %s %s:\n", getpid(), what, src);
+  for (int i = 0; i < COPY_METHOD_COUNT; i++) {
+    if (copy_stats[i].files == 0) {
+      continue;
+    }
+    double secs = atomic_load(&copy_stats[i].nsec) / 1e9;
+    double mib = atomic_load(&copy_stats[i].bytes) / (1024.0 * 1024.0);
+    printf("  %-16s %lu files, %.1f MiB, %.1f MiB/s\n", copy_method_names[i],
+           atomic_load(&copy_stats[i].files), mib,
+           secs > 0 ? mib / secs : 0.0);
+  }
+  fflush(stdout);
+}
+
+// A file copy that only gets its name once it is complete: an unnamed
+// O_TMPFILE in the target directory, or a hidden temporary name where the
+// filesystem has no O_TMPFILE. A target that is hard-linked is written in
+// place instead, so that every name of it sees the new data.
+struct PendingFile {
+  int fd;
+  int named;
+  int in_place;
+  char tmp_path[PATH_MAX];
+};
+
+atomic_uint temp_counter;
+
+int is_temp_name(const char *name) {
+  return strncmp(name, TEMP_PREFIX, strlen(TEMP_PREFIX)) == 0;
+}
+
+// Temporary files of this process may still be written to or waiting to
+// be renamed into place. Those of another PID were left by a dead job.
+int is_own_temp_name(const char *name) {
+  return is_temp_name(name) &&
+         strtol(name + strlen(TEMP_PREFIX), NULL, 10) == getpid();
+}
+
+void temp_path_for(const char *path, char *tmp_path, size_t size) {
+  const char *slash = strrchr(path, '/');
+  int dir_len = slash ? (int)(slash - path + 1) : 0;
+  snprintf(tmp_path, size, "%.*s" TEMP_PREFIX "%d.%u", dir_len, path,
+           getpid(), atomic_fetch_add(&temp_counter, 1));
+}
+
+// Returns the fd to write the copy of path to, or -1.
+int open_pending(const char *path, mode_t mode, struct PendingFile *file) {
+  struct stat st;
+
+  file->named = 0;
+  file->in_place = 0;
+  if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+    file->in_place = 1;
+    file->fd = TEMP_FAILURE_RETRY(open(path, O_WRONLY | O_TRUNC, mode));
+    return file->fd;
+  }
+
+  char dir[PATH_MAX];
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL) {
+    snprintf(dir, sizeof(dir), ".");
+  } else {
+    snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path),
+             path);
+  }
+  file->fd = TEMP_FAILURE_RETRY(open(dir, O_TMPFILE | O_WRONLY, mode));
+  if (file->fd >= 0) {
+    return file->fd;
+  }
+
+  temp_path_for(path, file->tmp_path, sizeof(file->tmp_path));
+  file->fd = TEMP_FAILURE_RETRY(
+      open(file->tmp_path, O_WRONLY | O_CREAT | O_EXCL, mode));
+  file->named = file->fd >= 0;
+  return file->fd;
+}
+
+// Drops a copy that could not be completed. The fd may be closed already.
+void discard_pending(struct PendingFile *file) {
+  if (file->fd >= 0) {
+    TEMP_FAILURE_RETRY(close(file->fd));
+    file->fd = -1;
+  }
+  if (file->named) {
+    unlink(file->tmp_path);
+    file->named = 0;
+  }
+}
+
+// Gives a complete copy the name path, replacing whatever held it, and
+// closes it. Readers see either the old file or the whole new one.
+int publish_pending(struct PendingFile *file, const char *path) {
+  int result = 0;
+
+  if (!file->in_place && !file->named) {
+    // linkat with AT_EMPTY_PATH would need CAP_DAC_READ_SEARCH.
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", file->fd);
+    temp_path_for(path, file->tmp_path, sizeof(file->tmp_path));
+    if (linkat(AT_FDCWD, fd_path, AT_FDCWD, file->tmp_path,
+               AT_SYMLINK_FOLLOW) < 0) {
+      perror("linkat");
+      result = -1;
+    } else {
+      file->named = 1;
+    }
+  }
+
+  if (file->named && result == 0 && rename(file->tmp_path, path) < 0) {
+    perror("rename");
+    result = -1;
+  }
+  if (result == 0) {
+    file->named = 0;
+  }
+  discard_pending(file);
+  return result;
+}
+
+// Copies src to every path in dsts. Each destination gets a reflink when
+// the filesystem allows it. Sparse sources are copied extent by extent,
+// otherwise a single remaining destination goes through the in-kernel
+// copy paths and several share one read of the source. Copies are only
+// published under their names once complete.
+int copy_file_fanout(const char *src, const char *const *dsts, int count,
+                     mode_t mode, struct stat *src_st) {
+  int f_src = TEMP_FAILURE_RETRY(open(src, O_RDONLY));
+  if (f_src == -1) {
+    perror("open\n");
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(f_src, &st) < 0) {
+    TEMP_FAILURE_RETRY(close(f_src));
+    perror("fstat\n");
+    return -1;
+  }
+  if (src_st) {
+    *src_st = st;
+  }
+
+  struct PendingFile files[MAX_DESTINATIONS];
+  int f_dsts[MAX_DESTINATIONS];
+  int pending[MAX_DESTINATIONS];
+  int pending_count = 0;
+  int result = 0;
+
+  for (int i = 0; i < count; i++) {
+    f_dsts[i] = open_pending(dsts[i], mode, &files[i]);
+
+    if (f_dsts[i] == -1) {
+      perror("open\n");
+      result = -1;
+    } else if (copy_fd_reflink(f_src, f_dsts[i]) < 0) {
+      pending[pending_count++] = i;
+    }
+  }
+
+  if (pending_count > 0 && is_sparse(&st)) {
+    int sparse[MAX_DESTINATIONS];
+    for (int i = 0; i < pending_count; i++) {
+      sparse[i] = f_dsts[pending[i]];
+    }
+    if (copy_fds_sparse(f_src, sparse, pending_count, st.st_size) < 0) {
+      result = -1;
+    }
+    for (int i = 0; i < pending_count; i++) {
+      f_dsts[pending[i]] = sparse[i];
+    }
+  } else if (pending_count == 1) {
+    unsigned long long copied;
+    int *f_dst = &f_dsts[pending[0]];
+    if (copy_fd(f_src, *f_dst, COPY_RANGE, &copied) < 0) {
+      TEMP_FAILURE_RETRY(close(*f_dst));
+      *f_dst = -1;
+      result = -1;
+    }
+  } else if (pending_count > 1) {
+    int shared[MAX_DESTINATIONS];
+    for (int i = 0; i < pending_count; i++) {
+      shared[i] = f_dsts[pending[i]];
+    }
+    if (copy_fds_shared(f_src, shared, pending_count) < 0) {
+      result = -1;
+    }
+    for (int i = 0; i < pending_count; i++) {
+      f_dsts[pending[i]] = shared[i];
+    }
+  }
+
+  struct timespec times[2];
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+
+  for (int i = 0; i < count; i++) {
+    if (f_dsts[i] < 0) {
+      // Closed by the copy that failed.
+      files[i].fd = -1;
+      discard_pending(&files[i]);
+      continue;
+    }
+
+    if (futimens(f_dsts[i], times) < 0) {
+      result = -1;
+    }
+
+    if (fchmod(f_dsts[i], mode) < 0) {
+      perror("fchmod");
+      result = -1;
+    }
+    if (publish_pending(&files[i], dsts[i]) < 0) {
+      result = -1;
+    }
+  }
+
+  TEMP_FAILURE_RETRY(close(f_src));
+  return result;
+}
+
+int copy_file_data(const char *src, const char *dst, mode_t mode) {
+  return copy_file_fanout(src, &dst, 1, mode, NULL);
+}
+
+uint64_t hash_bytes(uint64_t hash, const unsigned char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t manifest_key(const char *rel) {
+  uint64_t key =
+      hash_bytes(14695981039346656037ULL, (const unsigned char *)rel,
+                 strlen(rel));
+  return key ? key : 1;
+}
+
+// Hash of the content of a file, used when -H asks the manifest to keep
+// one. Returns 0 when the file can not be read.
+uint64_t hash_file(const char *path) {
+  int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY));
+  if (fd < 0) {
+    return 0;
+  }
+
+  unsigned char *buf = malloc(HASH_BUF_SIZE);
+  if (buf == NULL) {
+    ERR("malloc");
+  }
+
+  uint64_t hash = 14695981039346656037ULL;
+  ssize_t len;
+  while ((len = bulk_read(fd, (char *)buf, HASH_BUF_SIZE)) > 0) {
+    hash = hash_bytes(hash, buf, len);
+  }
+
+  free(buf);
+  TEMP_FAILURE_RETRY(close(fd));
+  return len < 0 || hash == 0 ? 0 : hash;
+}
+
+size_t manifest_size(uint64_t capacity) {
+  return sizeof(struct ManifestHeader) +
+         capacity * sizeof(struct ManifestEntry);
+}
+
+int manifest_map(struct Manifest *manifest, size_t size) {
+  void *map =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, manifest->fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  manifest->map_size = size;
+  manifest->header = map;
+  manifest->entries = (struct ManifestEntry *)(manifest->header + 1);
+  return 0;
+}
+
+struct ManifestEntry *manifest_slot(struct Manifest *manifest, uint64_t key) {
+  uint64_t mask = manifest->header->capacity - 1;
+  uint64_t slot = key & mask;
+  while (manifest->entries[slot].key != 0 &&
+         manifest->entries[slot].key != key) {
+    slot = (slot + 1) & mask;
+  }
+  return &manifest->entries[slot];
+}
+
+// Rebuilds the table with new_capacity slots. With sweep set, entries
+// not seen in the current generation are dropped.
+int manifest_rebuild(struct Manifest *manifest, uint64_t new_capacity,
+                     int sweep) {
+  uint64_t old_capacity = manifest->header->capacity;
+  uint32_t generation = manifest->header->generation;
+  struct ManifestEntry *live =
+      malloc((manifest->header->count + 1) * sizeof(struct ManifestEntry));
+  uint64_t live_count = 0;
+
+  if (live == NULL) {
+    ERR("malloc");
+  }
+  for (uint64_t i = 0; i < old_capacity; i++) {
+    struct ManifestEntry *entry = &manifest->entries[i];
+    if (entry->key != 0 &&
+        (!sweep || entry->generation == (uint16_t)generation)) {
+      live[live_count++] = *entry;
+    }
+  }
+
+  // The old table stays mapped until the new one is, so a failed resize
+  // leaves it as it was. Growth reserves the blocks up front: a store into
+  // a sparse page of a full disk raises SIGBUS.
+  size_t size = manifest_size(new_capacity);
+  size_t old_size = manifest->map_size;
+  struct ManifestHeader *old_header = manifest->header;
+  if (size != old_size) {
+    int err = size > old_size ? posix_fallocate(manifest->fd, 0, size) : 0;
+    if (err != 0) {
+      errno = err;
+      perror("manifest resize");
+    }
+    if (err != 0 || manifest_map(manifest, size) < 0) {
+      manifest->broken = 1;
+      // The next job starts the manifest over instead of trusting it.
+      memset(old_header->magic, 0, sizeof(old_header->magic));
+      msync(old_header, old_size, MS_ASYNC);
+      free(live);
+      return -1;
+    }
+    munmap(old_header, old_size);
+    if (size < old_size && ftruncate(manifest->fd, size) < 0) {
+      perror("manifest resize");
+    }
+  }
+
+  memset(manifest->entries, 0, new_capacity * sizeof(struct ManifestEntry));
+  manifest->header->capacity = new_capacity;
+  manifest->header->count = live_count;
+  for (uint64_t i = 0; i < live_count; i++) {
+    *manifest_slot(manifest, live[i].key) = live[i];
+  }
+  free(live);
+  return 0;
+}
+
+struct Manifest *manifest_open(const char *dst_root, int hash_files) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dst_root, MANIFEST_NAME);
+
+  struct Manifest *manifest = calloc(1, sizeof(struct Manifest));
+  if (manifest == NULL) {
+    ERR("calloc");
+  }
+  manifest->hash_files = hash_files;
+  pthread_mutex_init(&manifest->lock, NULL);
+
+  manifest->fd = TEMP_FAILURE_RETRY(
+      open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR));
+  struct stat st;
+  if (manifest->fd < 0 || fstat(manifest->fd, &st) < 0) {
+    perror("manifest open");
+    goto fail;
+  }
+
+  int valid = (size_t)st.st_size >= sizeof(struct ManifestHeader);
+  if (valid) {
+    if (manifest_map(manifest, st.st_size) < 0) {
+      goto fail;
+    }
+    uint64_t capacity = manifest->header->capacity;
+    valid = memcmp(manifest->header->magic, MANIFEST_MAGIC,
+                   sizeof(MANIFEST_MAGIC)) == 0 &&
+            capacity > 0 && (capacity & (capacity - 1)) == 0 &&
+            manifest_size(capacity) == (size_t)st.st_size;
+    if (!valid) {
+      munmap(manifest->header, manifest->map_size);
+    }
+  }
+
+  if (!valid) {
+    // Missing or torn: start over, which means one full copy.
+    size_t size = manifest_size(MANIFEST_INIT_CAP);
+    int err = ftruncate(manifest->fd, 0) < 0
+                  ? errno
+                  : posix_fallocate(manifest->fd, 0, size);
+    if (err != 0) {
+      errno = err;
+      perror("manifest init");
+      goto fail;
+    }
+    if (manifest_map(manifest, size) < 0) {
+      goto fail;
+    }
+    memcpy(manifest->header->magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+    manifest->header->capacity = MANIFEST_INIT_CAP;
+  }
+
+  manifest->header->generation++;
+  return manifest;
+
+fail:
+  if (manifest->fd >= 0) {
+    close(manifest->fd);
+  }
+  pthread_mutex_destroy(&manifest->lock);
+  free(manifest);
+  return NULL;
+}
+
+void manifest_close(struct Manifest *manifest) {
+  if (manifest == NULL) {
+    return;
+  }
+  if (!manifest->broken) {
+    msync(manifest->header, manifest->map_size, MS_SYNC);
+  }
+  munmap(manifest->header, manifest->map_size);
+  close(manifest->fd);
+  pthread_mutex_destroy(&manifest->lock);
+  free(manifest);
+}
+
+// Looks rel up and marks the entry as still alive. Returns 1 when found.
+int manifest_check(struct Manifest *manifest, const char *rel,
+                   struct ManifestEntry *out) {
+  pthread_mutex_lock(&manifest->lock);
+  struct ManifestEntry *entry = manifest_slot(manifest, manifest_key(rel));
+  int found = !manifest->broken && entry->key != 0;
+  if (found) {
+    entry->generation = manifest->header->generation;
+    *out = *entry;
+  }
+  pthread_mutex_unlock(&manifest->lock);
+  return found;
+}
+
+// Returns -1 when the table could not grow; the manifest is broken then
+// and the caller drops it.
+int manifest_record(struct Manifest *manifest, const char *rel,
+                    const struct stat *st, uint64_t hash, uint64_t tail_hash) {
+  pthread_mutex_lock(&manifest->lock);
+  if (manifest->broken ||
+      ((manifest->header->count + 1) * 4 > manifest->header->capacity * 3 &&
+       manifest_rebuild(manifest, manifest->header->capacity * 2, 0) < 0)) {
+    pthread_mutex_unlock(&manifest->lock);
+    return -1;
+  }
+
+  uint64_t key = manifest_key(rel);
+  struct ManifestEntry *entry = manifest_slot(manifest, key);
+  if (entry->key == 0) {
+    manifest->header->count++;
+  }
+  entry->size = st->st_size;
+  entry->ino = st->st_ino;
+  entry->hash = hash;
+  entry->tail_hash = tail_hash;
+  entry->mtime_sec = st->st_mtim.tv_sec;
+  entry->mtime_nsec = st->st_mtim.tv_nsec;
+  entry->kind = S_ISDIR(st->st_mode) ? MANIFEST_DIR : MANIFEST_FILE;
+  entry->generation = manifest->header->generation;
+  entry->key = key;
+  pthread_mutex_unlock(&manifest->lock);
+  return 0;
+}
+
+void manifest_forget(struct Manifest *manifest, const char *rel) {
+  pthread_mutex_lock(&manifest->lock);
+  struct ManifestEntry *entry = manifest_slot(manifest, manifest_key(rel));
+  if (!manifest->broken && entry->key != 0) {
+    // Lookups stop at free slots, so the table is rebuilt without holes
+    // only when it is swept. Until then the entry just never matches.
+    entry->size = UINT64_MAX;
+    entry->kind = 0;
+  }
+  pthread_mutex_unlock(&manifest->lock);
+}
+
+// Drops everything the scan since manifest_open did not come across.
+// Returns -1 when the manifest is broken.
+int manifest_sweep(struct Manifest *manifest) {
+  pthread_mutex_lock(&manifest->lock);
+  uint64_t capacity = manifest->header->capacity;
+  while (capacity > MANIFEST_INIT_CAP &&
+         manifest->header->count * 4 < capacity) {
+    capacity /= 2;
+  }
+  int result = -1;
+  if (!manifest->broken && manifest_rebuild(manifest, capacity, 1) == 0) {
+    msync(manifest->header, manifest->map_size, MS_ASYNC);
+    result = 0;
+  }
+  pthread_mutex_unlock(&manifest->lock);
+  return result;
+}
+
+// Stops dst from using a broken manifest. Threads already holding it see
+// it as empty until the destination is freed.
+void drop_manifest(struct Destination *dst, struct Manifest *manifest) {
+  struct Manifest *expected = manifest;
+  if (atomic_compare_exchange_strong(&dst->manifest, &expected, NULL)) {
+    dst->dropped_manifest = manifest;
+    fprintf(stderr, "%s: manifest dropped, comparing files in full\n",
+            dst->path);
+  }
+}
+
+int manifest_matches(const struct ManifestEntry *entry, const struct stat *st) {
+  return entry->size == (uint64_t)st->st_size &&
+         entry->mtime_sec == st->st_mtim.tv_sec &&
+         entry->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec &&
+         entry->kind ==
+             (S_ISDIR(st->st_mode) ? MANIFEST_DIR : MANIFEST_FILE);
+}
+
+// Whether dst already holds the source file src_path (stat in st) as the
+// manifest recorded it. The backup copy itself must still be there with
+// the right size. A changed inode alone is forgiven when the manifest
+// keeps content hashes and the content did not change.
+int dst_up_to_date(struct Destination *dst, int dst_dir_fd, const char *name,
+                   const char *rel, const char *src_path,
+                   const struct stat *st) {
+  struct ManifestEntry entry;
+  struct stat dst_st;
+  struct Manifest *manifest = dst->manifest;
+
+  if (manifest == NULL || !manifest_check(manifest, rel, &entry) ||
+      !manifest_matches(&entry, st)) {
+    return 0;
+  }
+
+  if (fstatat(dst_dir_fd, name, &dst_st, AT_SYMLINK_NOFOLLOW) < 0 ||
+      !S_ISREG(dst_st.st_mode) || dst_st.st_size != st->st_size) {
+    return 0;
+  }
+
+  if (entry.ino == st->st_ino) {
+    return 1;
+  }
+  if (entry.hash != 0 && hash_file(src_path) == entry.hash) {
+    if (manifest_record(manifest, rel, st, entry.hash, entry.tail_hash) < 0) {
+      drop_manifest(dst, manifest);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+int has_manifest(const char *dst_root) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s", dst_root, MANIFEST_NAME) >=
+      (int)sizeof(path)) {
+    return 0;
+  }
+  return access(path, F_OK) == 0;
+}
+
+// The bookkeeping files kept in the root of a destination.
+int is_meta_name(const char *name) {
+  return strcmp(name, MANIFEST_NAME) == 0 ||
+         strcmp(name, SIGNATURE_DIR) == 0 || strcmp(name, TRASH_DIR) == 0 ||
+         strncmp(name, SYNC_PREFIX, strlen(SYNC_PREFIX)) == 0;
+}
+
+int is_meta_rel(const char *rel) {
+  return rel[0] == '/' && is_meta_name(rel + 1);
+}
+
+int manifest_has_key(struct Manifest *manifest, uint64_t key) {
+  pthread_mutex_lock(&manifest->lock);
+  int found = !manifest->broken && manifest_slot(manifest, key)->key != 0;
+  pthread_mutex_unlock(&manifest->lock);
+  return found;
+}
+
+// Signature of a backup copy for delta replication: the hash of each
+// DELTA_BLOCK_SIZE block, valid as long as the copy still has the size,
+// inode and mtime recorded in the header.
+struct SignatureHeader {
+  char magic[8];
+  uint32_t block_size;
+  uint32_t reserved;
+  uint64_t size;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+void signature_path(const char *dst_root, const char *rel, char *path,
+                    size_t size) {
+  snprintf(path, size, "%s/%s/%016llx", dst_root, SIGNATURE_DIR,
+           (unsigned long long)manifest_key(rel));
+}
+
+uint64_t block_hash(const unsigned char *data, size_t len) {
+  uint64_t hash = len * 0x9e3779b97f4a7c15ULL;
+  size_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash ^= word * 0x87c37b91114253d5ULL;
+    hash = ((hash << 31) | (hash >> 33)) * 0x4cf5ad432745937fULL;
+  }
+  for (; i < len; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// Loads the block hashes of the backup f_dst (stat in dst_st) from its
+// signature, or computes them from the copy itself when the signature is
+// missing or stale. Returns the number of blocks or -1.
+long long load_signature(const char *sig_path, int f_dst,
+                         const struct stat *dst_st, uint64_t **hashes,
+                         unsigned char *buf) {
+  long long blocks =
+      (dst_st->st_size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+  struct SignatureHeader header;
+
+  *hashes = malloc((blocks + 1) * sizeof(uint64_t));
+  if (*hashes == NULL) {
+    ERR("malloc");
+  }
+
+  int fd = TEMP_FAILURE_RETRY(open(sig_path, O_RDONLY));
+  if (fd >= 0) {
+    ssize_t want = blocks * sizeof(uint64_t);
+    int valid =
+        bulk_read(fd, (char *)&header, sizeof(header)) == sizeof(header) &&
+        memcmp(header.magic, SIGNATURE_MAGIC, sizeof(SIGNATURE_MAGIC)) == 0 &&
+        header.block_size == DELTA_BLOCK_SIZE &&
+        header.size == (uint64_t)dst_st->st_size &&
+        header.ino == dst_st->st_ino &&
+        header.mtime_sec == dst_st->st_mtim.tv_sec &&
+        header.mtime_nsec == dst_st->st_mtim.tv_nsec &&
+        bulk_read(fd, (char *)*hashes, want) == want;
+    TEMP_FAILURE_RETRY(close(fd));
+    if (valid) {
+      return blocks;
+    }
+  }
+
+  for (long long i = 0; i < blocks; i++) {
+    ssize_t len = TEMP_FAILURE_RETRY(
+        pread(f_dst, buf, DELTA_BLOCK_SIZE, i * DELTA_BLOCK_SIZE));
+    if (len < 0) {
+      free(*hashes);
+      return -1;
+    }
+    (*hashes)[i] = block_hash(buf, len);
+  }
+  return blocks;
+}
+
+int save_signature(const char *dst_root, const char *sig_path, int f_dst,
+                   const uint64_t *hashes, long long blocks) {
+  char dir[PATH_MAX];
+  struct SignatureHeader header;
+  struct stat dst_st;
+
+  if (fstat(f_dst, &dst_st) < 0) {
+    return -1;
+  }
+
+  snprintf(dir, sizeof(dir), "%s/%s", dst_root, SIGNATURE_DIR);
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    perror("mkdir signatures");
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SIGNATURE_MAGIC, sizeof(SIGNATURE_MAGIC));
+  header.block_size = DELTA_BLOCK_SIZE;
+  header.size = dst_st.st_size;
+  header.ino = dst_st.st_ino;
+  header.mtime_sec = dst_st.st_mtim.tv_sec;
+  header.mtime_nsec = dst_st.st_mtim.tv_nsec;
+
+  int fd = TEMP_FAILURE_RETRY(
+      open(sig_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (fd < 0) {
+    perror("open signature");
+    return -1;
+  }
+
+  ssize_t want = blocks * sizeof(uint64_t);
+  int result = bulk_write(fd, (char *)&header, sizeof(header)) ==
+                       sizeof(header) &&
+                       bulk_write(fd, (char *)hashes, want) == want
+                   ? 0
+                   : -1;
+  TEMP_FAILURE_RETRY(close(fd));
+  if (result < 0) {
+    unlink(sig_path);
+  }
+  return result;
+}
+
+// Brings the existing backup dst_path of src_path up to date by writing
+// only the blocks whose hash differs from the signature of the copy.
+// Returns -1 when dst_path can not be updated in place, the caller then
+// falls back to a full copy.
+int delta_copy_file(const char *src_path, const char *dst_root,
+                    const char *rel, const char *dst_path, mode_t mode,
+                    struct stat *src_st) {
+  char sig_path[PATH_MAX];
+  struct stat dst_st;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  signature_path(dst_root, rel, sig_path, sizeof(sig_path));
+
+  int f_src = TEMP_FAILURE_RETRY(open(src_path, O_RDONLY));
+  if (f_src < 0) {
+    return -1;
+  }
+  int f_dst = TEMP_FAILURE_RETRY(open(dst_path, O_RDWR | O_NOFOLLOW));
+  if (f_dst < 0 || fstat(f_src, src_st) < 0 || fstat(f_dst, &dst_st) < 0 ||
+      !S_ISREG(dst_st.st_mode)) {
+    if (f_dst >= 0) {
+      TEMP_FAILURE_RETRY(close(f_dst));
+    }
+    TEMP_FAILURE_RETRY(close(f_src));
+    return -1;
+  }
+
+  unsigned char *buf = malloc(DELTA_BLOCK_SIZE);
+  if (buf == NULL) {
+    ERR("malloc");
+  }
+
+  uint64_t *old_hashes;
+  long long old_blocks =
+      load_signature(sig_path, f_dst, &dst_st, &old_hashes, buf);
+  long long blocks =
+      (src_st->st_size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+  uint64_t *hashes = malloc((blocks + 1) * sizeof(uint64_t));
+  unsigned long long written = 0;
+  int result = old_blocks < 0 ? -1 : 0;
+
+  if (hashes == NULL) {
+    ERR("malloc");
+  }
+
+  for (long long i = 0; result == 0 && i < blocks; i++) {
+    off_t offset = i * DELTA_BLOCK_SIZE;
+    ssize_t len =
+        TEMP_FAILURE_RETRY(pread(f_src, buf, DELTA_BLOCK_SIZE, offset));
+    if (len <= 0) {
+      // The source shrank under us, the next event copies it again.
+      blocks = i;
+      break;
+    }
+
+    hashes[i] = block_hash(buf, len);
+    if (i < old_blocks && hashes[i] == old_hashes[i]) {
+      continue;
+    }
+
+    // A block that became zeros is punched out of the copy.
+    if (is_zero(buf, len) &&
+        fallocate(f_dst, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  len) == 0) {
+      continue;
+    }
+    if (pwrite_all(f_dst, (char *)buf, len, offset) < 0) {
+      perror("pwrite");
+      result = -1;
+    }
+    written += len;
+    account_io(len, 1);
+  }
+
+  if (result == 0 && ftruncate(f_dst, src_st->st_size) < 0) {
+    perror("ftruncate");
+    result = -1;
+  }
+
+  struct timespec times[2] = {src_st->st_atim, src_st->st_mtim};
+  if (result == 0 && (futimens(f_dst, times) < 0 || fchmod(f_dst, mode) < 0)) {
+    perror("futimens");
+    result = -1;
+  }
+
+  if (result == 0) {
+    save_signature(dst_root, sig_path, f_dst, hashes, blocks);
+    record_copy(COPY_DELTA, written, &start);
+  } else {
+    unlink(sig_path);
+  }
+
+  if (old_blocks >= 0) {
+    free(old_hashes);
+  }
+  free(hashes);
+  free(buf);
+  TEMP_FAILURE_RETRY(close(f_dst));
+  TEMP_FAILURE_RETRY(close(f_src));
+  return result;
+}
+
+// Removes the signatures of files the manifest no longer knows.
+void sweep_signatures(struct Destination *dst) {
+  struct Manifest *manifest = dst->manifest;
+  char dir_path[PATH_MAX];
+  snprintf(dir_path, sizeof(dir_path), "%s/%s", dst->path, SIGNATURE_DIR);
+
+  DIR *d = opendir(dir_path);
+  struct dirent *entry;
+
+  if (d == NULL) {
+    return;
+  }
+
+  while ((entry = readdir(d)) != NULL) {
+    char *end;
+    unsigned long long key = strtoull(entry->d_name, &end, 16);
+    if (entry->d_name[0] == '.' || *end != '\0' ||
+        (manifest && manifest_has_key(manifest, key))) {
+      continue;
+    }
+    unlinkat(dirfd(d), entry->d_name, 0);
+  }
+
+  if (closedir(d)) {
     ERR("closedir");
   }
 }
 
-int copy_file_data(const char *src, const char *dst, mode_t mode) {
-  int f_src = TEMP_FAILURE_RETRY(open(src, O_RDONLY));
-  if (f_src == -1) {
-    perror("open\n");
+void queue_init(struct CopyQueue *queue) {
+  memset(queue, 0, sizeof(*queue));
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+}
+
+void queue_destroy(struct CopyQueue *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+}
+
+// Blocks while the queue is full, so directory discovery never runs too far
+// ahead of the copier threads.
+void queue_push(struct CopyQueue *queue, const char *rel, mode_t mode,
+                unsigned int dst_mask) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == COPY_QUEUE_LEN) {
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  }
+  struct CopyTask *task =
+      &queue->tasks[(queue->head + queue->count) % COPY_QUEUE_LEN];
+  task->rel = strdup(rel);
+  task->mode = mode;
+  task->dst_mask = dst_mask;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Returns 0 once the queue is closed and drained.
+int queue_pop(struct CopyQueue *queue, struct CopyTask *task) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !queue->closed) {
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+  if (queue->count == 0) {
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+  }
+  *task = queue->tasks[queue->head];
+  queue->head = (queue->head + 1) % COPY_QUEUE_LEN;
+  queue->count--;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+  return 1;
+}
+
+void queue_close(struct CopyQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Hash of the TAIL_CHECK_SIZE bytes before offset size in fd, the part an
+// append has to leave alone.
+uint64_t tail_hash_fd(int fd, off_t size) {
+  unsigned char buf[TAIL_CHECK_SIZE];
+  off_t offset = size > TAIL_CHECK_SIZE ? size - TAIL_CHECK_SIZE : 0;
+  ssize_t len = TEMP_FAILURE_RETRY(pread(fd, buf, size - offset, offset));
+  return len == size - offset ? block_hash(buf, len) : 0;
+}
+
+uint64_t tail_hash_path(const char *path, off_t size) {
+  int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY));
+  if (fd < 0) {
+    return 0;
+  }
+  uint64_t hash = tail_hash_fd(fd, size);
+  TEMP_FAILURE_RETRY(close(fd));
+  return hash;
+}
+
+// Copies only what was appended to src_path since the manifest of dst
+// last saw it. The file must be the same inode, no shorter than before
+// and end in the same last block, otherwise -1 asks for a full copy.
+int tail_copy_file(struct Destination *dst, const char *rel,
+                   const char *src_path, const char *dst_path, mode_t mode,
+                   struct stat *src_st) {
+  struct ManifestEntry entry;
+  struct stat dst_st;
+  struct timespec start;
+  struct Manifest *manifest = dst->manifest;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (manifest == NULL || !manifest_check(manifest, rel, &entry) ||
+      entry.kind != MANIFEST_FILE || entry.tail_hash == 0) {
+    return -1;
+  }
+
+  int f_src = TEMP_FAILURE_RETRY(open(src_path, O_RDONLY));
+  if (f_src < 0) {
+    return -1;
+  }
+  if (fstat(f_src, src_st) < 0 || src_st->st_ino != entry.ino ||
+      (uint64_t)src_st->st_size <= entry.size ||
+      tail_hash_fd(f_src, entry.size) != entry.tail_hash) {
+    TEMP_FAILURE_RETRY(close(f_src));
+    return -1;
+  }
+
+  int f_dst = TEMP_FAILURE_RETRY(open(dst_path, O_WRONLY | O_NOFOLLOW));
+  if (f_dst < 0 || fstat(f_dst, &dst_st) < 0 || !S_ISREG(dst_st.st_mode) ||
+      (uint64_t)dst_st.st_size != entry.size) {
+    if (f_dst >= 0) {
+      TEMP_FAILURE_RETRY(close(f_dst));
+    }
+    TEMP_FAILURE_RETRY(close(f_src));
+    return -1;
+  }
+
+  unsigned long long copied = 0;
+  int result = 0;
+  if (lseek(f_src, entry.size, SEEK_SET) < 0 ||
+      lseek(f_dst, entry.size, SEEK_SET) < 0) {
+    result = -1;
+  } else if (copy_fd_kernel(f_src, f_dst, COPY_RANGE, &copied) < 0) {
+    result = copy_can_fall_back(errno)
+                 ? copy_fd_buffered(f_src, f_dst, &copied)
+                 : -1;
+  }
+
+  struct timespec times[2] = {src_st->st_atim, src_st->st_mtim};
+  if (result == 0 && (futimens(f_dst, times) < 0 || fchmod(f_dst, mode) < 0)) {
+    result = -1;
+  }
+  if (result == 0) {
+    record_copy(COPY_TAIL, copied, &start);
+  } else {
+    perror("tail copy");
+  }
+
+  TEMP_FAILURE_RETRY(close(f_dst));
+  TEMP_FAILURE_RETRY(close(f_src));
+  return result;
+}
+
+// Group commit of what a job wrote to its backups. Changes are collected
+// here until the commit thread makes them durable together.
+struct Committer {
+  enum Durability mode;
+  int window_ms;
+  long long window_bytes;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  // Destinations written to, and in fsync mode every path changed, since
+  // the last commit.
+  char **roots;
+  int root_count;
+  int root_capacity;
+  char **paths;
+  int path_count;
+  int path_capacity;
+  long long bytes;
+  int changes;
+  // When the window of the first change since the last commit closes.
+  struct timespec deadline;
+  int stop;
+  pthread_t thread;
+  int started;
+  struct WorkQueue *work;
+  struct JobStatus *status;
+};
+
+void append_path(char ***paths, int *count, int *capacity, const char *path) {
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    char **grown = realloc(*paths, *capacity * sizeof(char *));
+    if (grown == NULL) {
+      ERR("realloc");
+    }
+    *paths = grown;
+  }
+  (*paths)[(*count)++] = strdup(path);
+}
+
+// Records that path in the backup dst changed, so the next commit makes
+// it durable. In fsync mode the writeback of a file starts right away.
+void note_written(struct Destination *dst, const char *path,
+                  long long bytes) {
+  struct Committer *committer = dst->committer;
+  if (committer == NULL) {
+    return;
+  }
+
+  if (committer->mode == DURABILITY_FSYNC && bytes > 0) {
+    int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd >= 0) {
+      sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+      TEMP_FAILURE_RETRY(close(fd));
+    }
+  }
+
+  pthread_mutex_lock(&committer->lock);
+  int known = 0;
+  for (int i = 0; i < committer->root_count && !known; i++) {
+    known = strcmp(committer->roots[i], dst->path) == 0;
+  }
+  if (!known) {
+    append_path(&committer->roots, &committer->root_count,
+                &committer->root_capacity, dst->path);
+  }
+  if (committer->mode == DURABILITY_FSYNC) {
+    append_path(&committer->paths, &committer->path_count,
+                &committer->path_capacity, path);
+  }
+  committer->bytes += bytes;
+  committer->changes++;
+  if (committer->changes == 1) {
+    clock_gettime(CLOCK_MONOTONIC, &committer->deadline);
+    timespec_add_ms(&committer->deadline, committer->window_ms);
+  }
+  if (committer->changes == 1 || committer->bytes >= committer->window_bytes) {
+    pthread_cond_signal(&committer->wake);
+  }
+  pthread_mutex_unlock(&committer->lock);
+}
+
+// Copies src_root + rel to the same relative path in every destination.
+int replicate_file(const char *src_root, const char *rel,
+                   struct Destination **dsts, int dst_count, mode_t mode) {
+  char src_path[PATH_MAX];
+  char dst_paths[MAX_DESTINATIONS][PATH_MAX];
+  const char *dst_ptrs[MAX_DESTINATIONS];
+  int appended[MAX_DESTINATIONS];
+  int full_count = 0;
+  int result = 0;
+  struct stat st;
+
+  // All destinations of one call belong to the same job.
+  copy_job = dst_count > 0 ? dsts[0]->status : NULL;
+  snprintf(src_path, sizeof(src_path), "%s%s", src_root, rel);
+  for (int i = 0; i < dst_count; i++) {
+    snprintf(dst_paths[i], PATH_MAX, "%s%s", dsts[i]->path, rel);
+
+    // Growing logs only need what was added since the last copy.
+    appended[i] = tail_copy_file(dsts[i], rel, src_path, dst_paths[i], mode,
+                                 &st) == 0;
+    if (appended[i]) {
+      continue;
+    }
+
+    // Large files that already have a backup copy are patched in place.
+    long long threshold = dsts[i]->delta_threshold;
+    if (threshold > 0 && stat(src_path, &st) == 0 &&
+        st.st_size >= threshold &&
+        delta_copy_file(src_path, dsts[i]->path, rel, dst_paths[i], mode,
+                        &st) == 0) {
+      continue;
+    }
+    dst_ptrs[full_count++] = dst_paths[i];
+  }
+
+  if (full_count > 0) {
+    result = copy_file_fanout(src_path, dst_ptrs, full_count, mode, &st);
+  }
+  copy_job = NULL;
+  struct JobStatus *status = dst_count > 0 ? dsts[0]->status : NULL;
+  if (result < 0) {
+    if (status) {
+      atomic_fetch_add_explicit(&status->errors, 1, memory_order_relaxed);
+    }
+    return result;
+  }
+  if (status) {
+    atomic_fetch_add_explicit(&status->files_replicated, 1,
+                              memory_order_relaxed);
+  }
+  for (int i = 0; i < dst_count; i++) {
+    note_written(dsts[i], dst_paths[i], st.st_size);
+  }
+
+  uint64_t hash = 0;
+  int hashed = 0;
+  for (int i = 0; i < dst_count; i++) {
+    struct Manifest *manifest = dsts[i]->manifest;
+    if (manifest == NULL) {
+      continue;
+    }
+    // Appends do not read the whole file, so they drop the content hash.
+    if (manifest->hash_files && !appended[i] && !hashed) {
+      hash = hash_file(src_path);
+      hashed = 1;
+    }
+    // The tail is read back from the copy: that is what the next append
+    // has to extend.
+    if (manifest_record(manifest, rel, &st,
+                        manifest->hash_files && !appended[i] ? hash : 0,
+                        tail_hash_path(dst_paths[i], st.st_size)) < 0) {
+      drop_manifest(dsts[i], manifest);
+    }
+  }
+  return result;
+}
+
+// Forgets rel in the manifest of every destination after it was removed
+// or renamed away in the backups.
+void forget_replicated(struct Destination **dsts, int dst_count,
+                       const char *rel) {
+  for (int i = 0; i < dst_count; i++) {
+    struct Manifest *manifest = dsts[i]->manifest;
+    if (manifest) {
+      manifest_forget(manifest, rel);
+    }
+
+    char sig_path[PATH_MAX];
+    signature_path(dsts[i]->path, rel, sig_path, sizeof(sig_path));
+    unlink(sig_path);
+  }
+}
+
+void *copy_worker(void *arg) {
+  struct CopyQueue *queue = arg;
+  struct CopyTask task;
+
+  while (queue_pop(queue, &task)) {
+    struct Destination *dsts[MAX_DESTINATIONS];
+    int dst_count = 0;
+    for (int i = 0; i < queue->dst_count; i++) {
+      if (task.dst_mask & (1u << i)) {
+        dsts[dst_count++] = queue->dsts[i];
+      }
+    }
+    replicate_file(queue->src_root, task.rel, dsts, dst_count, task.mode);
+    free(task.rel);
+  }
+  return NULL;
+}
+
+// Recreates the symlink src_path as dst_path. Targets pointing into root_src
+// are redirected to the same place inside root_dst.
+void copy_symlink(const char *src_path, const char *dst_path,
+                  const char *root_src, const char *root_dst) {
+  char target[PATH_MAX];
+  ssize_t len =
+      TEMP_FAILURE_RETRY(readlink(src_path, target, sizeof(target) - 1));
+  if (len == -1) {
+    return;
+  }
+  target[len] = '\0';
+  unlink(dst_path);
+
+  if (strncmp(target, root_src, strlen(root_src)) == 0) {
+    char new_target[PATH_MAX];
+    snprintf(new_target, sizeof(new_target), "%s%s", root_dst,
+             target + strlen(root_src));
+    TEMP_FAILURE_RETRY(symlink(new_target, dst_path));
+  }
+
+  else {
+    TEMP_FAILURE_RETRY(symlink(target, dst_path));
+  }
+}
+
+// Removes what dst_dir, a directory of the backup dst, holds but src_dir
+// no longer does, or holds with another file type. Temporary files of
+// copies still in flight are left to their workers.
+void remove_stale_entries(int src_fd, struct Destination *dst, int dst_fd,
+                          int is_root) {
+  int fd = TEMP_FAILURE_RETRY(dup(dst_fd));
+  if (fd < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+    perror("dup");
+    if (fd >= 0) {
+      TEMP_FAILURE_RETRY(close(fd));
+    }
+    return;
+  }
+
+  struct DirReader dir;
+  struct dirent64 *entry;
+  dir_open(&dir, fd);
+  while ((entry = dir_next(&dir)) != NULL) {
+    if ((is_root && is_meta_name(entry->d_name)) ||
+        is_own_temp_name(entry->d_name)) {
+      continue;
+    }
+
+    struct stat src_st;
+    if (fstatat(src_fd, entry->d_name, &src_st, AT_SYMLINK_NOFOLLOW) < 0 ||
+        (int)IFTODT(src_st.st_mode) != dir_entry_type(fd, entry)) {
+      trash_at(dst, fd, entry->d_name);
+    }
+  }
+  dir_close(&dir);
+}
+
+// Files with more than one hard link, by (dev, ino), so every further
+// name of an inode becomes a link to the first backup copy instead of a
+// copy of its own. Paths are relative to the walked root.
+struct LinkEntry {
+  dev_t dev;
+  ino_t ino;
+  char *rel;
+  // Set while the backup of the first name is being written.
+  int copying;
+};
+
+struct PendingLink {
+  char *rel;
+  char *target;
+  unsigned int dst_mask;
+};
+
+struct LinkMap {
+  struct LinkEntry *entries;
+  int capacity;
+  int count;
+  struct PendingLink *pending;
+  int pending_count;
+  int pending_capacity;
+  // Set for a map shared between threads: lock guards the entries, and
+  // copied is signalled when the first name of an inode is written.
+  pthread_mutex_t *lock;
+  pthread_cond_t *copied;
+};
+
+struct LinkEntry *link_slot(struct LinkMap *map, dev_t dev, ino_t ino) {
+  unsigned int slot =
+      (unsigned int)((ino * 0x9e3779b97f4a7c15ULL) ^ dev) & (map->capacity - 1);
+  while (map->entries[slot].rel != NULL &&
+         (map->entries[slot].dev != dev || map->entries[slot].ino != ino)) {
+    slot = (slot + 1) & (map->capacity - 1);
+  }
+  return &map->entries[slot];
+}
+
+void grow_links(struct LinkMap *map) {
+  struct LinkEntry *old = map->entries;
+  int old_capacity = map->capacity;
+
+  map->capacity = old_capacity ? old_capacity * 2 : LINK_MAP_INIT_CAP;
+  map->entries = calloc(map->capacity, sizeof(struct LinkEntry));
+  if (map->entries == NULL) {
+    ERR("calloc");
+  }
+
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].rel != NULL) {
+      *link_slot(map, old[i].dev, old[i].ino) = old[i];
+    }
+  }
+  free(old);
+}
+
+// Returns the name under which the inode of st (found as rel) was seen
+// first, or NULL when rel is the first name and now stands for the inode.
+// A remembered name that no longer points to the inode under root is
+// replaced.
+const char *claim_link(struct LinkMap *map, const char *root, const char *rel,
+                       const struct stat *st) {
+  if ((map->count + 1) * 4 > map->capacity * 3) {
+    grow_links(map);
+  }
+
+  struct LinkEntry *entry = link_slot(map, st->st_dev, st->st_ino);
+  if (entry->rel != NULL) {
+    char path[PATH_MAX];
+    struct stat first_st;
+
+    snprintf(path, sizeof(path), "%s%s", root, entry->rel);
+    if (strcmp(entry->rel, rel) != 0 && lstat(path, &first_st) == 0 &&
+        first_st.st_dev == st->st_dev && first_st.st_ino == st->st_ino) {
+      return entry->rel;
+    }
+    free(entry->rel);
+  } else {
+    map->count++;
+  }
+
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->rel = strdup(rel);
+  return NULL;
+}
+
+// claim_link for a map that may be shared. When rel is another name of
+// an inode, waits until the first name is copied and returns 1 with that
+// name in target. Otherwise rel is the first name, and link_copied must
+// follow once its backup is written.
+int claim_link_copy(struct LinkMap *map, const char *root, const char *rel,
+                    const struct stat *st, char *target) {
+  if (map->lock) {
+    pthread_mutex_lock(map->lock);
+  }
+  for (;;) {
+    const char *first = claim_link(map, root, rel, st);
+    struct LinkEntry *entry = link_slot(map, st->st_dev, st->st_ino);
+    if (first == NULL) {
+      entry->copying = 1;
+    } else if (entry->copying && map->copied) {
+      pthread_cond_wait(map->copied, map->lock);
+      continue;
+    } else {
+      snprintf(target, PATH_MAX, "%s", first);
+    }
+    if (map->lock) {
+      pthread_mutex_unlock(map->lock);
+    }
+    return first != NULL;
+  }
+}
+
+void link_copied(struct LinkMap *map, const struct stat *st,
+                 const char *rel) {
+  if (map->lock) {
+    pthread_mutex_lock(map->lock);
+  }
+  struct LinkEntry *entry = link_slot(map, st->st_dev, st->st_ino);
+  // Another thread may have taken the inode over under a newer name.
+  if (entry->rel && strcmp(entry->rel, rel) == 0) {
+    entry->copying = 0;
+  }
+  if (map->copied) {
+    pthread_cond_broadcast(map->copied);
+  }
+  if (map->lock) {
+    pthread_mutex_unlock(map->lock);
+  }
+}
+
+void defer_link(struct LinkMap *map, const char *rel, const char *target,
+                unsigned int dst_mask) {
+  if (map->pending_count == map->pending_capacity) {
+    map->pending_capacity =
+        map->pending_capacity ? map->pending_capacity * 2 : LINK_MAP_INIT_CAP;
+    map->pending = realloc(map->pending,
+                           map->pending_capacity * sizeof(struct PendingLink));
+    if (map->pending == NULL) {
+      ERR("realloc");
+    }
+  }
+
+  struct PendingLink *link = &map->pending[map->pending_count++];
+  link->rel = strdup(rel);
+  link->target = strdup(target);
+  link->dst_mask = dst_mask;
+}
+
+void free_links(struct LinkMap *map) {
+  for (int i = 0; i < map->capacity; i++) {
+    free(map->entries[i].rel);
+  }
+  free(map->entries);
+  free(map->pending);
+  memset(map, 0, sizeof(*map));
+}
+
+int same_inode(const char *a, const char *b) {
+  struct stat st_a, st_b;
+  return lstat(a, &st_a) == 0 && lstat(b, &st_b) == 0 &&
+         st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
+// Makes rel in every destination a hard link to its backup of target.
+// Destinations where that is impossible get a copy instead.
+void link_replicas(const char *src_root, const char *rel, const char *target,
+                   struct Destination **dsts, int dst_count,
+                   const struct stat *st) {
+  struct Destination *missed[MAX_DESTINATIONS];
+  int missed_count = 0;
+
+  for (int i = 0; i < dst_count; i++) {
+    char old_path[PATH_MAX];
+    char new_path[PATH_MAX];
+    snprintf(old_path, sizeof(old_path), "%s%s", dsts[i]->path, target);
+    snprintf(new_path, sizeof(new_path), "%s%s", dsts[i]->path, rel);
+
+    if (!same_inode(old_path, new_path)) {
+      if ((unlink(new_path) < 0 && errno != ENOENT) ||
+          link(old_path, new_path) < 0) {
+        missed[missed_count++] = dsts[i];
+        continue;
+      }
+    }
+
+    struct Manifest *manifest = dsts[i]->manifest;
+    if (manifest == NULL) {
+      continue;
+    }
+    if (manifest_record(manifest, rel, st, 0,
+                        tail_hash_path(new_path, st->st_size)) < 0) {
+      drop_manifest(dsts[i], manifest);
+    }
+  }
+
+  if (missed_count > 0) {
+    replicate_file(src_root, rel, missed, missed_count, st->st_mode);
+  }
+}
+
+// Creates the links deferred by a walk, once the copies they point to
+// are written.
+void finish_links(struct LinkMap *map, const char *src_root,
+                  struct Destination **dsts, int dst_count) {
+  for (int i = 0; i < map->pending_count; i++) {
+    struct PendingLink *link = &map->pending[i];
+    struct Destination *masked[MAX_DESTINATIONS];
+    int masked_count = 0;
+    char src_path[PATH_MAX];
+    struct stat st;
+
+    for (int j = 0; j < dst_count; j++) {
+      if (link->dst_mask & (1u << j)) {
+        masked[masked_count++] = dsts[j];
+      }
+    }
+
+    snprintf(src_path, sizeof(src_path), "%s%s", src_root, link->rel);
+    if (lstat(src_path, &st) == 0 && S_ISREG(st.st_mode)) {
+      link_replicas(src_root, link->rel, link->target, masked, masked_count,
+                    &st);
+    }
+    free(link->rel);
+    free(link->target);
+  }
+  map->pending_count = 0;
+}
+
+// Walks the directory src_root + rel, open as src_fd, creating
+// directories and symlinks in every destination right away. dst_fds hold
+// the same directory in each destination, or -1 where it could not be
+// created. Regular files are copied inline when queue is NULL, otherwise
+// they are handed to the copier threads draining the queue. Further names
+// of a hard-linked file are collected in deferred.
+int copy_recursive(const char *src_root, const char *rel, int src_fd,
+                   const int *dst_fds, struct Destination **dsts,
+                   int dst_count, struct CopyQueue *queue,
+                   struct LinkMap *links, struct LinkMap *deferred) {
+  struct stat st;
+
+  if (fstat(src_fd, &st) < 0) {
+    perror("fstat\n");
+    return -1;
+  }
+
+  for (int i = 0; i < dst_count; i++) {
+    // The listing of a directory whose mtime the manifest already knows
+    // has not changed, so nothing in the backup can be stale.
+    struct ManifestEntry known;
+    struct Manifest *manifest = dsts[i]->manifest;
+    if (dst_fds[i] < 0) {
+      continue;
+    }
+    if (manifest &&
+        !(manifest_check(manifest, rel[0] ? rel : "/", &known) &&
+          manifest_matches(&known, &st))) {
+      remove_stale_entries(src_fd, dsts[i], dst_fds[i], rel[0] == '\0');
+      if (manifest_record(manifest, rel[0] ? rel : "/", &st, 0, 0) < 0) {
+        drop_manifest(dsts[i], manifest);
+      }
+    }
+  }
+
+  int fd = TEMP_FAILURE_RETRY(dup(src_fd));
+  if (fd < 0) {
+    perror("dup\n");
+    return -1;
+  }
+
+  struct DirReader dir;
+  struct dirent64 *entry;
+  dir_open(&dir, fd);
+  while ((entry = dir_next(&dir)) != NULL) {
+    const char *name = entry->d_name;
+    char child_rel[PATH_MAX];
+    char src_path[PATH_MAX];
+
+    snprintf(child_rel, sizeof(child_rel), "%s/%s", rel, name);
+    snprintf(src_path, sizeof(src_path), "%s%s", src_root, child_rel);
+
+    if (is_meta_rel(child_rel) || is_temp_name(name)) {
+      continue;
+    }
+
+    int type = dir_entry_type(fd, entry);
+
+    if (type == DT_DIR) {
+      int child_src = open_dir_at(fd, name);
+      struct stat child_st;
+      int child_dsts[MAX_DESTINATIONS];
+      int created = 0;
+
+      if (child_src < 0 || fstat(child_src, &child_st) < 0) {
+        perror("openat\n");
+        if (child_src >= 0) {
+          TEMP_FAILURE_RETRY(close(child_src));
+        }
+        continue;
+      }
+
+      for (int i = 0; i < dst_count; i++) {
+        child_dsts[i] = -1;
+        if (dst_fds[i] < 0) {
+          continue;
+        }
+        if (mkdirat(dst_fds[i], name, child_st.st_mode) < 0 &&
+            errno != EEXIST) {
+          perror("mkdir\n");
+          continue;
+        }
+        child_dsts[i] = open_dir_at(dst_fds[i], name);
+        created += child_dsts[i] >= 0;
+      }
+
+      if (created > 0) {
+        copy_recursive(src_root, child_rel, child_src, child_dsts, dsts,
+                       dst_count, queue, links, deferred);
+      }
+
+      for (int i = 0; i < dst_count; i++) {
+        if (child_dsts[i] >= 0) {
+          TEMP_FAILURE_RETRY(close(child_dsts[i]));
+        }
+      }
+      TEMP_FAILURE_RETRY(close(child_src));
+    }
+
+    else if (type == DT_REG) {
+      struct Destination *need[MAX_DESTINATIONS];
+      int need_count = 0;
+      unsigned int need_mask = 0;
+      struct stat entry_st;
+
+      if (fstatat(fd, name, &entry_st, AT_SYMLINK_NOFOLLOW) < 0) {
+        perror("lstat\n");
+        continue;
+      }
+
+      char target[PATH_MAX];
+      int first_name = entry_st.st_nlink > 1;
+      if (first_name &&
+          claim_link_copy(links, src_root, child_rel, &entry_st, target)) {
+        for (int i = 0; i < dst_count; i++) {
+          char old_path[PATH_MAX];
+          char new_path[PATH_MAX];
+          snprintf(old_path, sizeof(old_path), "%s%s", dsts[i]->path, target);
+          snprintf(new_path, sizeof(new_path), "%s%s", dsts[i]->path,
+                   child_rel);
+          if (dst_fds[i] >= 0 && !same_inode(old_path, new_path)) {
+            need_mask |= 1u << i;
+          }
+        }
+        if (need_mask) {
+          defer_link(deferred, child_rel, target, need_mask);
+        }
+        continue;
+      }
+
+      for (int i = 0; i < dst_count; i++) {
+        if (dst_fds[i] >= 0 &&
+            !dst_up_to_date(dsts[i], dst_fds[i], name, child_rel, src_path,
+                            &entry_st)) {
+          need[need_count++] = dsts[i];
+          need_mask |= 1u << i;
+        }
+      }
+
+      // Other names of the inode wait for the first one, so it is
+      // copied right here.
+      if (need_count > 0 && queue && !first_name) {
+        queue_push(queue, child_rel, entry_st.st_mode, need_mask);
+      } else if (need_count > 0) {
+        replicate_file(src_root, child_rel, need, need_count,
+                       entry_st.st_mode);
+      }
+      if (first_name) {
+        link_copied(links, &entry_st, child_rel);
+      }
+    }
+
+    else if (type == DT_LNK) {
+      for (int i = 0; i < dst_count; i++) {
+        char dst_path[PATH_MAX];
+        if (dst_fds[i] < 0) {
+          continue;
+        }
+        snprintf(dst_path, sizeof(dst_path), "%s%s", dsts[i]->path,
+                 child_rel);
+        copy_symlink(src_path, dst_path, src_root, dsts[i]->path);
+      }
+    }
+  }
+  dir_close(&dir);
+
+  return 0;
+}
+
+// Copies src_root + rel to every destination with the given number of
+// copy threads. links carries the hard links known from earlier walks of
+// the same root, or is NULL. Every file is checked against the backup,
+// but only directories whose mtime differs from the manifest are searched
+// for stale entries: an in-place write leaves the directory mtime alone.
+int copy_tree(const char *src_root, const char *rel,
+              struct Destination **dsts, int dst_count, int threads,
+              struct LinkMap *links) {
+  struct LinkMap local_links = {0};
+  struct LinkMap deferred = {0};
+  if (links == NULL) {
+    links = &local_links;
+  }
+
+  struct CopyQueue queue;
+  pthread_t workers[MAX_COPY_THREADS];
+  int started = 0;
+
+  queue_init(&queue);
+  queue.src_root = src_root;
+  queue.dsts = dsts;
+  queue.dst_count = dst_count;
+  for (; threads > 1 && started < threads; started++) {
+    if (create_quiet_thread(&workers[started], copy_worker, &queue) != 0) {
+      perror("pthread_create");
+      break;
+    }
+  }
+
+  int result = -1;
+  char src_base[PATH_MAX];
+  int src_fd;
+  struct stat st;
+  int dst_fds[MAX_DESTINATIONS];
+  int created = 0;
+
+  snprintf(src_base, sizeof(src_base), "%s%s", src_root, rel);
+  src_fd = open_dir_at(AT_FDCWD, src_base);
+  if (src_fd < 0 || fstat(src_fd, &st) < 0) {
+    perror("opendir\n");
+    st.st_mode = 0;
+  }
+
+  for (int i = 0; i < dst_count; i++) {
+    char dst_base[PATH_MAX];
+    snprintf(dst_base, sizeof(dst_base), "%s%s", dsts[i]->path, rel);
+
+    dst_fds[i] = -1;
+    if (st.st_mode == 0) {
+      continue;
+    }
+    if (TEMP_FAILURE_RETRY(mkdir(dst_base, st.st_mode)) < 0 &&
+        errno != EEXIST) {
+      perror("mkdir\n");
+      continue;
+    }
+    dst_fds[i] = open_dir_at(AT_FDCWD, dst_base);
+    created += dst_fds[i] >= 0;
+  }
+
+  if (created > 0) {
+    result = copy_recursive(src_root, rel, src_fd, dst_fds, dsts, dst_count,
+                            started > 0 ? &queue : NULL, links, &deferred);
+  }
+
+  for (int i = 0; i < dst_count; i++) {
+    if (dst_fds[i] >= 0) {
+      TEMP_FAILURE_RETRY(close(dst_fds[i]));
+    }
+  }
+  if (src_fd >= 0) {
+    TEMP_FAILURE_RETRY(close(src_fd));
+  }
+
+  queue_close(&queue);
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  queue_destroy(&queue);
+
+  finish_links(&deferred, src_root, dsts, dst_count);
+  free_links(&deferred);
+  if (links == &local_links) {
+    free_links(&local_links);
+  }
+  return result;
+}
+
+int remove_recursive(const char *path) {
+  return remove_at(AT_FDCWD, path);
+}
+
+enum WorkOp {
+  WORK_REPLICATE,
+  WORK_COPY_FILE,
+  WORK_REMOVE,
+  WORK_MOVE,
+  WORK_ADD_DESTINATION,
+  WORK_REMOVE_DESTINATION
+};
+
+enum ScanKind { SCAN_INITIAL, SCAN_RECONCILE, SCAN_POLL };
+
+// A replication step handed from the event reader to the workers. rel is
+// relative to the source root; a move also names where it came from. A
+// change of the destinations covers the whole tree, rel "", so it runs
+// alone between the steps before and after it; old_rel is the path of the
+// destination then.
+struct WorkItem {
+  enum WorkOp op;
+  unsigned long long seq;
+  // When the event behind the step was read.
+  unsigned long long event_ns;
+  char *rel;
+  char *old_rel;
+  // Copy threads the sync of an added destination runs with.
+  int threads;
+  int running;
+  struct WorkItem *next;
+};
+
+// Replication steps in event order. A worker takes the oldest item whose
+// paths are neither at, above nor below those of an earlier item, so the
+// operations on one path stay in order while unrelated paths replicate
+// side by side.
+struct WorkQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct WorkItem *head;
+  struct WorkItem *tail;
+  unsigned long long next_seq;
+  // Queued and running items.
+  atomic_int depth;
+  int peak;
+  int reported;
+  int closed;
+  pthread_t workers[MAX_COPY_THREADS];
+  int worker_count;
+  struct JobStatus *status;
+};
+
+void work_init(struct WorkQueue *queue) {
+  memset(queue, 0, sizeof(*queue));
+  queue->next_seq = 1;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->changed, NULL);
+}
+
+void work_destroy(struct WorkQueue *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->changed);
+}
+
+// The sequence number every step up to which is done. Call with the lock
+// held.
+unsigned long long work_replicated_seq(const struct WorkQueue *queue) {
+  return queue->head ? queue->head->seq - 1 : queue->next_seq - 1;
+}
+
+// Shows the parent how far the queue got. Call with the lock held.
+void publish_progress(struct WorkQueue *queue) {
+  struct JobStatus *status = queue->status;
+  if (status == NULL) {
+    return;
+  }
+  atomic_store(&status->queued_seq, queue->next_seq - 1);
+  atomic_store(&status->replicated_seq, work_replicated_seq(queue));
+  atomic_store(&status->pending_steps, atomic_load(&queue->depth));
+  atomic_store(&status->oldest_event_ns,
+               queue->head ? queue->head->event_ns : 0);
+}
+
+// Queues a copy of step.
+void work_push(struct WorkQueue *queue, const struct WorkItem *step) {
+  struct WorkItem *item = calloc(1, sizeof(struct WorkItem));
+  if (item == NULL) {
+    ERR("calloc");
+  }
+  item->op = step->op;
+  item->rel = strdup(step->rel);
+  item->old_rel = step->old_rel ? strdup(step->old_rel) : NULL;
+  item->event_ns = step->event_ns;
+  item->threads = step->threads;
+
+  pthread_mutex_lock(&queue->lock);
+  item->seq = queue->next_seq++;
+  if (queue->tail) {
+    queue->tail->next = item;
+  } else {
+    queue->head = item;
+  }
+  queue->tail = item;
+  int depth = atomic_fetch_add(&queue->depth, 1) + 1;
+  if (depth > queue->peak) {
+    queue->peak = depth;
+  }
+  publish_progress(queue);
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+int paths_overlap(const char *a, const char *b) {
+  return path_under(a, b) || path_under(b, a);
+}
+
+int work_conflicts(const struct WorkItem *a, const struct WorkItem *b) {
+  if (paths_overlap(a->rel, b->rel)) {
+    return 1;
+  }
+  if (a->old_rel && (paths_overlap(a->old_rel, b->rel) ||
+                     (b->old_rel && paths_overlap(a->old_rel, b->old_rel)))) {
+    return 1;
+  }
+  return b->old_rel && paths_overlap(a->rel, b->old_rel);
+}
+
+// Blocks until some item may run and marks it running. Returns NULL once
+// the queue is closed and drained.
+struct WorkItem *work_take(struct WorkQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  for (;;) {
+    int seen = 0;
+    for (struct WorkItem *item = queue->head; item && seen < WORK_LOOKAHEAD;
+         item = item->next, seen++) {
+      if (item->running) {
+        continue;
+      }
+      struct WorkItem *earlier = queue->head;
+      while (earlier != item && !work_conflicts(earlier, item)) {
+        earlier = earlier->next;
+      }
+      if (earlier == item) {
+        item->running = 1;
+        pthread_mutex_unlock(&queue->lock);
+        return item;
+      }
+    }
+    if (queue->head == NULL && queue->closed) {
+      pthread_mutex_unlock(&queue->lock);
+      return NULL;
+    }
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  }
+}
+
+void work_done(struct WorkQueue *queue, struct WorkItem *item) {
+  pthread_mutex_lock(&queue->lock);
+  struct WorkItem **link = &queue->head;
+  struct WorkItem *prev = NULL;
+  while (*link != item) {
+    prev = *link;
+    link = &(*link)->next;
+  }
+  *link = item->next;
+  if (queue->tail == item) {
+    queue->tail = prev;
+  }
+  atomic_fetch_sub(&queue->depth, 1);
+  publish_progress(queue);
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+
+  free(item->rel);
+  free(item->old_rel);
+  free(item);
+}
+
+void work_wait_idle(struct WorkQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->head != NULL) {
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  }
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Lets the workers finish what is queued and joins them.
+void work_close(struct WorkQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+
+  for (int i = 0; i < queue->worker_count; i++) {
+    pthread_join(queue->workers[i], NULL);
+  }
+  queue->worker_count = 0;
+}
+
+int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Makes one batch of changes durable. roots are the destinations written
+// to, paths what changed in them in fsync mode.
+void commit_changes(enum Durability mode, char **roots, int root_count,
+                    char **paths, int path_count) {
+  if (mode == DURABILITY_SYNCFS) {
+    dev_t synced[MAX_DESTINATIONS];
+    int synced_count = 0;
+    for (int i = 0; i < root_count; i++) {
+      int fd = TEMP_FAILURE_RETRY(
+          open(roots[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      struct stat st;
+      if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+          TEMP_FAILURE_RETRY(close(fd));
+        }
+        continue;
+      }
+      // Backups on one filesystem share a single syncfs.
+      int done = 0;
+      for (int j = 0; j < synced_count && !done; j++) {
+        done = synced[j] == st.st_dev;
+      }
+      if (!done) {
+        if (syncfs(fd) < 0) {
+          perror("syncfs");
+        }
+        if (synced_count < MAX_DESTINATIONS) {
+          synced[synced_count++] = st.st_dev;
+        }
+      }
+      TEMP_FAILURE_RETRY(close(fd));
+    }
+    return;
+  }
+
+  // Sorted, the paths of one directory are next to each other and every
+  // directory is synced once, after all its files.
+  qsort(paths, path_count, sizeof(char *), compare_paths);
+  char dir[PATH_MAX] = "";
+  for (int i = 0; i <= path_count; i++) {
+    const char *slash = i < path_count ? strrchr(paths[i], '/') : NULL;
+    int dir_len = slash ? (int)(slash - paths[i]) : 0;
+
+    if (dir[0] && (i == path_count || (int)strlen(dir) != dir_len ||
+                   strncmp(dir, paths[i], dir_len) != 0)) {
+      int fd = TEMP_FAILURE_RETRY(
+          open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      if (fd >= 0) {
+        if (fsync(fd) < 0) {
+          perror("fsync");
+        }
+        TEMP_FAILURE_RETRY(close(fd));
+      }
+      dir[0] = '\0';
+    }
+    if (i == path_count) {
+      break;
+    }
+
+    snprintf(dir, sizeof(dir), "%.*s", dir_len, paths[i]);
+    int fd = TEMP_FAILURE_RETRY(open(paths[i], O_RDONLY | O_CLOEXEC));
+    if (fd >= 0) {
+      sync_file_range(fd, 0, 0,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+      TEMP_FAILURE_RETRY(close(fd));
+    }
+  }
+}
+
+// Commits the collected changes and moves durable_seq up to the steps
+// that were complete when the batch was cut. Call with the lock held; it
+// is dropped while the batch is written out.
+void commit_batch(struct Committer *committer) {
+  // Every step up to seq has recorded its changes by now.
+  pthread_mutex_lock(&committer->work->lock);
+  unsigned long long seq = work_replicated_seq(committer->work);
+  pthread_mutex_unlock(&committer->work->lock);
+
+  char **roots = committer->roots;
+  int root_count = committer->root_count;
+  char **paths = committer->paths;
+  int path_count = committer->path_count;
+  committer->roots = NULL;
+  committer->root_count = committer->root_capacity = 0;
+  committer->paths = NULL;
+  committer->path_count = committer->path_capacity = 0;
+  committer->bytes = 0;
+  committer->changes = 0;
+  pthread_mutex_unlock(&committer->lock);
+
+  commit_changes(committer->mode, roots, root_count, paths, path_count);
+  if (committer->status) {
+    atomic_store(&committer->status->durable_seq, seq);
+  }
+  for (int i = 0; i < root_count; i++) {
+    free(roots[i]);
+  }
+  for (int i = 0; i < path_count; i++) {
+    free(paths[i]);
+  }
+  free(roots);
+  free(paths);
+
+  pthread_mutex_lock(&committer->lock);
+}
+
+// Waits for changes, lets the window fill, then commits them.
+void *commit_work(void *arg) {
+  struct Committer *committer = arg;
+
+  pthread_mutex_lock(&committer->lock);
+  for (;;) {
+    while (committer->changes == 0 && !committer->stop) {
+      pthread_cond_wait(&committer->wake, &committer->lock);
+    }
+    if (committer->changes == 0) {
+      break;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    timespec_add_ms(&deadline, committer->window_ms);
+    while (!committer->stop && committer->bytes < committer->window_bytes) {
+      if (pthread_cond_timedwait(&committer->wake, &committer->lock,
+                                 &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    commit_batch(committer);
+  }
+  pthread_mutex_unlock(&committer->lock);
+  return NULL;
+}
+
+// Milliseconds until the collected changes are due for a commit, or -1
+// when there are none.
+long commit_left_ms(struct Committer *committer) {
+  pthread_mutex_lock(&committer->lock);
+  long left = -1;
+  if (committer->changes > 0) {
+    long until = ms_until(&committer->deadline);
+    left = committer->bytes >= committer->window_bytes || until < 0 ? 0
+                                                                     : until;
+  }
+  pthread_mutex_unlock(&committer->lock);
+  return left;
+}
+
+// Without a commit thread, as in the event loop, the job commits between
+// its steps once the window has closed.
+void commit_due(struct Committer *committer, int force) {
+  pthread_mutex_lock(&committer->lock);
+  if (committer->changes > 0 &&
+      (force || committer->bytes >= committer->window_bytes ||
+       ms_until(&committer->deadline) <= 0)) {
+    commit_batch(committer);
+  }
+  pthread_mutex_unlock(&committer->lock);
+}
+
+void start_committer(struct Committer *committer) {
+  committer->started =
+      create_quiet_thread(&committer->thread, commit_work, committer) == 0;
+  if (!committer->started) {
+    perror("pthread_create");
+  }
+}
+
+// Commits what is left and stops the commit thread.
+void stop_committer(struct Committer *committer) {
+  pthread_mutex_lock(&committer->lock);
+  committer->stop = 1;
+  pthread_cond_signal(&committer->wake);
+  pthread_mutex_unlock(&committer->lock);
+  if (committer->started) {
+    pthread_join(committer->thread, NULL);
+    committer->started = 0;
+  } else {
+    commit_due(committer, 1);
+  }
+}
+
+struct PendingMove {
+  uint32_t cookie;
+  int is_dir;
+  char *src_path;
+  struct timespec deadline;
+};
+
+// Regular files written since their last copy, keyed by source path. Same
+// open-addressing scheme as WatchMap.
+struct DirtyPath {
+  char *path;
+  struct timespec first;
+  struct timespec deadline;
+};
+
+struct DirtySet {
+  struct DirtyPath *paths;
+  int capacity;
+  int count;
+  struct timespec next_deadline;
+};
+
+struct Monitor {
+  char *src_base;
+  struct JobOptions opts;
+  // Changed by a worker while no other step runs, under dsts_lock, which
+  // the event reader takes to look at them.
+  struct Destination *dsts[MAX_DESTINATIONS];
+  int dst_count;
+  // Removed while their initial sync was still running.
+  struct Destination *retired[MAX_DESTINATIONS];
+  int retired_count;
+  pthread_mutex_t dsts_lock;
+  int ctl_fd;
+  int notify_fd;
+  int root_wd;
+  // Set when notify_fd is a filesystem-wide fanotify group rather than
+  // inotify. Event directories are file handles resolved through
+  // mount_fd; the last one resolved is remembered.
+  int fanotify;
+  int mount_fd;
+  uint32_t fan_cookie;
+  // A sync marker read in this batch of events, 0 if none.
+  unsigned long long sync_marker;
+  // When the event being handled was read.
+  unsigned long long event_ns;
+  struct Trace *trace;
+  struct file_handle *fan_handle;
+  char fan_path[PATH_MAX];
+  // Directories that resolved outside the source, such as those of a
+  // backup on the same filesystem, hashed by handle. Only a directory
+  // rename can bring one into the source, and that clears them all.
+  struct file_handle *fan_outside[FAN_OUTSIDE_SLOTS];
+  struct WatchMap map;
+  struct PendingMove moves[MAX_PENDING_MOVES];
+  int move_count;
+  struct DirtySet dirty;
+  // The monitor thread only reads events and keeps the books; the copying
+  // is done by the workers of this queue, or right away without workers.
+  // They share links under links_lock.
+  struct WorkQueue work;
+  struct Committer commit;
+  // Shared with the parent for forked jobs, own_status in the event loop.
+  struct JobStatus *status;
+  struct JobStatus own_status;
+  struct LinkMap links;
+  pthread_mutex_t links_lock;
+  pthread_cond_t links_copied;
+  struct PollList polled;
+  // Guards map and polled while a rescan adds watches from its thread.
+  pthread_mutex_t watch_lock;
+  struct timespec next_poll;
+  int reported_polled;
+  // Background scans: the initial sync, a reconcile after the inotify
+  // queue overflowed, or a round over the polled subtrees. A scan works on
+  // its own snapshot of the destinations and of the relative paths it
+  // covers.
+  pthread_t scan_thread;
+  int scan_joinable;
+  atomic_int rescan_pending;
+  atomic_int scan_running;
+  struct Destination *scan_dsts[MAX_DESTINATIONS];
+  int scan_dst_count;
+  char **scan_rels;
+  int scan_rel_count;
+  enum ScanKind scan_kind;
+  // Event-loop mode: control messages posted by the loop thread, and the
+  // state only the loop thread touches. A job in the loop has neither
+  // workers nor a commit thread: its steps and commits run on the copier
+  // that runs the job.
+  int in_loop;
+  pthread_mutex_t ctl_lock;
+  struct ControlMessage *ctl_msgs;
+  int ctl_count;
+  int started;
+  int loop_busy;
+  int loop_kick;
+  int loop_registered;
+  int loop_ended;
+};
+
+int timespec_before(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+void deadline_after_ms(struct timespec *deadline, long ms) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  timespec_add_ms(deadline, ms);
+}
+
+unsigned int path_hash(const char *path) {
+  unsigned int hash = 2166136261u;
+  for (; *path; path++) {
+    hash = (hash ^ (unsigned char)*path) * 16777619u;
+  }
+  return hash;
+}
+
+struct DirtyPath *find_dirty(struct DirtySet *set, const char *path) {
+  if (set->capacity == 0) {
+    return NULL;
+  }
+
+  unsigned int slot = path_hash(path) & (set->capacity - 1);
+  while (set->paths[slot].path != NULL) {
+    if (strcmp(set->paths[slot].path, path) == 0) {
+      return &set->paths[slot];
+    }
+    slot = (slot + 1) & (set->capacity - 1);
+  }
+  return NULL;
+}
+
+struct DirtyPath *insert_dirty_slot(struct DirtySet *set, char *path) {
+  unsigned int slot = path_hash(path) & (set->capacity - 1);
+  while (set->paths[slot].path != NULL) {
+    slot = (slot + 1) & (set->capacity - 1);
+  }
+  set->paths[slot].path = path;
+  return &set->paths[slot];
+}
+
+void grow_dirty(struct DirtySet *set) {
+  struct DirtyPath *old = set->paths;
+  int old_capacity = set->capacity;
+
+  set->capacity = old_capacity ? old_capacity * 2 : DIRTY_SET_INIT_CAP;
+  set->paths = calloc(set->capacity, sizeof(struct DirtyPath));
+  if (set->paths == NULL) {
+    ERR("calloc");
+  }
+
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].path != NULL) {
+      *insert_dirty_slot(set, old[i].path) = old[i];
+    }
+  }
+  free(old);
+}
+
+// Marks path dirty and pushes its copy back by quiet_ms, but never further
+// than DIRTY_MAX_WAIT_FACTOR quiet periods after it first became dirty, so
+// a file that is written forever still gets replicated.
+void mark_dirty(struct DirtySet *set, const char *path, int quiet_ms) {
+  struct DirtyPath *dirty = find_dirty(set, path);
+
+  if (dirty == NULL) {
+    if ((set->count + 1) * 4 > set->capacity * 3) {
+      grow_dirty(set);
+    }
+    dirty = insert_dirty_slot(set, strdup(path));
+    clock_gettime(CLOCK_MONOTONIC, &dirty->first);
+    set->count++;
+  }
+
+  struct timespec latest = dirty->first;
+  timespec_add_ms(&latest, (long)quiet_ms * DIRTY_MAX_WAIT_FACTOR);
+  deadline_after_ms(&dirty->deadline, quiet_ms);
+  if (timespec_before(&latest, &dirty->deadline)) {
+    dirty->deadline = latest;
+  }
+
+  if (set->count == 1 ||
+      timespec_before(&dirty->deadline, &set->next_deadline)) {
+    set->next_deadline = dirty->deadline;
+  }
+}
+
+// Asks for the copy at the end of the current read() batch.
+void mark_dirty_ready(struct DirtySet *set, const char *path) {
+  struct DirtyPath *dirty = find_dirty(set, path);
+  if (dirty == NULL) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &dirty->deadline);
+  set->next_deadline = dirty->deadline;
+}
+
+void remove_dirty(struct DirtySet *set, const char *path) {
+  struct DirtyPath *dirty = find_dirty(set, path);
+  if (dirty == NULL) {
+    return;
+  }
+
+  unsigned int mask = set->capacity - 1;
+  unsigned int hole = dirty - set->paths;
+  free(dirty->path);
+  dirty->path = NULL;
+  set->count--;
+
+  unsigned int slot = (hole + 1) & mask;
+  while (set->paths[slot].path != NULL) {
+    unsigned int home = path_hash(set->paths[slot].path) & mask;
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      set->paths[hole] = set->paths[slot];
+      set->paths[slot].path = NULL;
+      hole = slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
+// Collects the dirty paths under dir (or every path when dir is NULL).
+// Returns a malloc'd array of strdup'd paths.
+char **collect_dirty(struct DirtySet *set, const char *dir, int *count) {
+  char **paths = malloc((set->count + 1) * sizeof(char *));
+  if (paths == NULL) {
+    ERR("malloc");
+  }
+
+  *count = 0;
+  for (int i = 0; i < set->capacity; i++) {
+    const char *path = set->paths[i].path;
+    if (path && (dir == NULL || path_under(path, dir))) {
+      paths[(*count)++] = strdup(path);
+    }
+  }
+  return paths;
+}
+
+void remove_dirty_under(struct DirtySet *set, const char *dir) {
+  int count;
+  char **paths = collect_dirty(set, dir, &count);
+  for (int i = 0; i < count; i++) {
+    remove_dirty(set, paths[i]);
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+// Follows a rename of old_dir to new_dir in the source.
+void rename_dirty(struct DirtySet *set, const char *old_dir,
+                  const char *new_dir, int quiet_ms) {
+  int count;
+  char **paths = collect_dirty(set, old_dir, &count);
+  for (int i = 0; i < count; i++) {
+    char new_path[PATH_MAX];
+    snprintf(new_path, sizeof(new_path), "%s%s", new_dir,
+             paths[i] + strlen(old_dir));
+    remove_dirty(set, paths[i]);
+    mark_dirty(set, new_path, quiet_ms);
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+void free_dirty(struct DirtySet *set) {
+  for (int i = 0; i < set->capacity; i++) {
+    free(set->paths[i].path);
+  }
+  free(set->paths);
+  memset(set, 0, sizeof(*set));
+}
+
+// Returns the part of src_path below the source root, or NULL.
+const char *rel_path(const struct Monitor *m, const char *src_path) {
+  size_t base_len = strlen(m->src_base);
+  if (strncmp(src_path, m->src_base, base_len) != 0) {
+    return NULL;
+  }
+  return src_path + base_len;
+}
+
+// fanotify resolves directories as they are when an event is read, not
+// when it happened. If one was renamed in between, the backups don't have
+// it under the new name yet and the change lands nowhere; a reconcile scan
+// puts that right.
+void check_fanotify_parent(struct Monitor *m, const char *rel) {
+  const char *name = strrchr(rel, '/');
+
+  if (name == NULL || is_meta_rel(rel)) {
+    return;
+  }
+  for (int i = 0; i < m->dst_count; i++) {
+    char parent[PATH_MAX];
+    struct stat st;
+
+    // A destination still being synced may lack it for another reason.
+    if (atomic_load(&m->dsts[i]->syncing) > 0) {
+      continue;
+    }
+    snprintf(parent, sizeof(parent), "%s%.*s", m->dsts[i]->path,
+             (int)(name - rel), rel);
+    if (lstat(parent, &st) < 0 || !S_ISDIR(st.st_mode)) {
+      atomic_store(&m->rescan_pending, 1);
+      return;
+    }
+  }
+}
+
+// Makes the backup of rel match the source in the given destinations,
+// whatever its type.
+void replicate_path_to(struct Monitor *m, const char *rel,
+                       struct Destination **dsts, int dst_count) {
+  char src_path[PATH_MAX];
+  struct stat st;
+
+  snprintf(src_path, sizeof(src_path), "%s%s", m->src_base, rel);
+  if (dst_count == 0 || lstat(src_path, &st) < 0) {
+    return;
+  }
+
+  // Steps already run side by side on the workers, so a directory is
+  // copied by the one worker that took it.
+  if (S_ISDIR(st.st_mode)) {
+    copy_tree(m->src_base, rel, dsts, dst_count, 1, &m->links);
+  }
+
+  else if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+    char target[PATH_MAX];
+    if (claim_link_copy(&m->links, m->src_base, rel, &st, target)) {
+      link_replicas(m->src_base, rel, target, dsts, dst_count, &st);
+    } else {
+      replicate_file(m->src_base, rel, dsts, dst_count, st.st_mode);
+      link_copied(&m->links, &st, rel);
+    }
+  }
+
+  else if (S_ISREG(st.st_mode)) {
+    replicate_file(m->src_base, rel, dsts, dst_count, st.st_mode);
+  }
+
+  else if (S_ISLNK(st.st_mode)) {
+    for (int i = 0; i < dst_count; i++) {
+      char dst_path[PATH_MAX];
+      snprintf(dst_path, sizeof(dst_path), "%s%s", dsts[i]->path, rel);
+      copy_symlink(src_path, dst_path, m->src_base, dsts[i]->path);
+    }
+  }
+}
+
+void remove_replicas(struct Monitor *m, const char *rel) {
+  for (int i = 0; i < m->dst_count; i++) {
+    char dst_path[PATH_MAX];
+    snprintf(dst_path, sizeof(dst_path), "%s%s", m->dsts[i]->path, rel);
+    trash_at(m->dsts[i], AT_FDCWD, dst_path);
+    note_written(m->dsts[i], dst_path, 0);
+  }
+  forget_replicated(m->dsts, m->dst_count, rel);
+}
+
+// Renames the backups of old_rel to rel, copying the source again where
+// that isn't possible.
+void move_replicas(struct Monitor *m, const char *old_rel, const char *rel) {
+  struct Destination *missed[MAX_DESTINATIONS];
+  int missed_count = 0;
+
+  for (int j = 0; j < m->dst_count; j++) {
+    char old_dst[PATH_MAX];
+    char new_dst[PATH_MAX];
+    snprintf(old_dst, sizeof(old_dst), "%s%s", m->dsts[j]->path, old_rel);
+    snprintf(new_dst, sizeof(new_dst), "%s%s", m->dsts[j]->path, rel);
+
+    int renamed = rename(old_dst, new_dst) == 0;
+    if (!renamed && errno != ENOENT) {
+      // The backup holds something of another type under the new name.
+      trash_at(m->dsts[j], AT_FDCWD, new_dst);
+      renamed = rename(old_dst, new_dst) == 0;
+    }
+    if (!renamed) {
+      missed[missed_count++] = m->dsts[j];
+    } else {
+      note_written(m->dsts[j], old_dst, 0);
+      note_written(m->dsts[j], new_dst, 0);
+    }
+  }
+
+  // Renamed backups are copied again after a restart, the manifest only
+  // knows them under the old name.
+  forget_replicated(m->dsts, m->dst_count, old_rel);
+  replicate_path_to(m, rel, missed, missed_count);
+}
+
+void add_destination(struct Monitor *m, const char *path, int threads);
+void remove_destination(struct Monitor *m, const char *path);
+
+void run_work(struct Monitor *m, const struct WorkItem *item) {
+  if (item->op == WORK_ADD_DESTINATION) {
+    add_destination(m, item->old_rel, item->threads);
+    return;
+  }
+  if (item->op == WORK_REMOVE_DESTINATION) {
+    remove_destination(m, item->old_rel);
+    return;
+  }
+  if (m->fanotify) {
+    check_fanotify_parent(m, item->rel);
+    if (item->old_rel) {
+      check_fanotify_parent(m, item->old_rel);
+    }
+  }
+
+  char src_path[PATH_MAX];
+  struct stat st;
+
+  switch (item->op) {
+    case WORK_REPLICATE:
+      replicate_path_to(m, item->rel, m->dsts, m->dst_count);
+      break;
+    case WORK_COPY_FILE:
+      snprintf(src_path, sizeof(src_path), "%s%s", m->src_base, item->rel);
+      if (lstat(src_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        replicate_file(m->src_base, item->rel, m->dsts, m->dst_count,
+                       st.st_mode);
+      }
+      break;
+    case WORK_REMOVE:
+      remove_replicas(m, item->rel);
+      break;
+    case WORK_MOVE:
+      move_replicas(m, item->old_rel, item->rel);
+      break;
+    default:
+      break;
+  }
+}
+
+int latency_bucket(unsigned long long ns) {
+  if (ns < LATENCY_SUB_BUCKETS) {
+    return ns;
+  }
+  int exponent = 63 - __builtin_clzll(ns);
+  int sub = (ns >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1);
+  return (exponent - 3) * LATENCY_SUB_BUCKETS + sub;
+}
+
+// The longest latency counted in bucket.
+unsigned long long latency_bucket_max(int bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) {
+    return bucket;
+  }
+  int exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+  unsigned long long sub = bucket % LATENCY_SUB_BUCKETS;
+  return ((LATENCY_SUB_BUCKETS + sub + 1) << (exponent - 4)) - 1;
+}
+
+// Counts how long item took and traces it when the job keeps a trace.
+void record_step(struct Monitor *m, const struct WorkItem *item) {
+  if (item->event_ns == 0) {
+    return;
+  }
+  unsigned long long done = monotonic_ns();
+  unsigned long long latency = done > item->event_ns ? done - item->event_ns
+                                                     : 0;
+  atomic_fetch_add_explicit(&m->status->latency[latency_bucket(latency)], 1,
+                            memory_order_relaxed);
+
+  struct Trace *trace = m->trace;
+  if (trace == NULL) {
+    return;
+  }
+  unsigned long long slot = atomic_fetch_add_explicit(&trace->next, 1,
+                                                      memory_order_relaxed);
+  struct TraceRecord *record = &trace->records[slot & (trace->capacity - 1)];
+  record->read_ns = item->event_ns;
+  record->done_ns = done;
+  record->seq = item->seq;
+  record->op = item->op;
+  record->path_hash = path_hash(item->rel);
+}
+
+// Writes the trace of m to a file next to the other temporary files.
+// Workers keep tracing meanwhile, so the newest records may be torn.
+void write_trace(struct Monitor *m) {
+  struct Trace *trace = m->trace;
+  if (trace == NULL) {
+    return;
+  }
+
+  const char *dir = getenv("TMPDIR");
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/sop-backup.%d.%u.trace", dir ? dir : "/tmp",
+           getpid(), path_hash(m->src_base));
+  int fd = TEMP_FAILURE_RETRY(
+      open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  if (fd < 0) {
+    perror("open trace");
+    return;
+  }
+
+  unsigned long long next = atomic_load(&trace->next);
+  unsigned long long count = next < trace->capacity ? next : trace->capacity;
+  struct TraceHeader header = {.version = 1,
+                               .record_size = sizeof(struct TraceRecord),
+                               .count = count};
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+  int ok = bulk_write(fd, (char *)&header, sizeof(header)) == sizeof(header);
+  for (unsigned long long i = next - count; ok && i < next; i++) {
+    struct TraceRecord *record = &trace->records[i & (trace->capacity - 1)];
+    ok = bulk_write(fd, (char *)record, sizeof(*record)) == sizeof(*record);
+  }
+  if (!ok) {
+    perror("write trace");
+  }
+  TEMP_FAILURE_RETRY(close(fd));
+  printf("[%d] %s: %llu traced steps written to %s\n", getpid(), m->src_base,
+         count, path);
+  fflush(stdout);
+}
+
+void *work_worker(void *arg) {
+  struct Monitor *m = arg;
+  struct WorkItem *item;
+
+  while ((item = work_take(&m->work)) != NULL) {
+    run_work(m, item);
+    record_step(m, item);
+    work_done(&m->work, item);
+  }
+  return NULL;
+}
+
+void start_workers(struct Monitor *m) {
+  for (; m->work.worker_count < m->opts.threads; m->work.worker_count++) {
+    if (create_quiet_thread(&m->work.workers[m->work.worker_count],
+                            work_worker, m) != 0) {
+      perror("pthread_create");
+      break;
+    }
+  }
+}
+
+// Hands a replication step to the workers, or does it right away when
+// none could be started.
+void submit_step(struct Monitor *m, const struct WorkItem *step) {
+  if (m->work.worker_count == 0) {
+    struct WorkItem item = *step;
+    pthread_mutex_lock(&m->work.lock);
+    item.seq = m->work.next_seq;
+    pthread_mutex_unlock(&m->work.lock);
+    run_work(m, &item);
+    record_step(m, &item);
+    pthread_mutex_lock(&m->work.lock);
+    m->work.next_seq++;
+    publish_progress(&m->work);
+    pthread_mutex_unlock(&m->work.lock);
+    return;
+  }
+  work_push(&m->work, step);
+}
+
+void submit_work(struct Monitor *m, enum WorkOp op, const char *rel,
+                 const char *old_rel) {
+  struct WorkItem step = {.op = op,
+                          .rel = (char *)rel,
+                          .old_rel = (char *)old_rel,
+                          .event_ns = m->event_ns};
+  submit_step(m, &step);
+}
+
+// Logs the backlog each time it doubles past WORK_REPORT_DEPTH, and once
+// it has been worked off.
+void report_work_depth(struct Monitor *m) {
+  struct WorkQueue *queue = &m->work;
+  int depth = atomic_load(&queue->depth);
+
+  if (depth >= WORK_REPORT_DEPTH && depth >= 2 * queue->reported) {
+    queue->reported = depth;
+    printf("[%d] %s: %d replication steps queued\n", getpid(), m->src_base,
+           depth);
+    fflush(stdout);
+  } else if (depth == 0 && queue->reported > 0) {
+    queue->reported = 0;
+    pthread_mutex_lock(&queue->lock);
+    int peak = queue->peak;
+    queue->peak = 0;
+    pthread_mutex_unlock(&queue->lock);
+    printf("[%d] %s: replication caught up, peak backlog %d steps\n",
+           getpid(), m->src_base, peak);
+    fflush(stdout);
+  }
+}
+
+// Queues rel for replication. A new directory is watched first so nothing
+// created in it while it is copied goes unnoticed.
+void replicate_path(struct Monitor *m, const char *rel) {
+  char src_path[PATH_MAX];
+  struct stat st;
+
+  snprintf(src_path, sizeof(src_path), "%s%s", m->src_base, rel);
+  if (!m->fanotify && lstat(src_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    add_watch_recursive(m->notify_fd, &m->map, &m->polled, 1, src_path,
+                        NULL);
+  }
+  submit_work(m, WORK_REPLICATE, rel, NULL);
+}
+
+void remove_from_destinations(struct Monitor *m, const char *rel) {
+  submit_work(m, WORK_REMOVE, rel, NULL);
+}
+
+// Drops the watches of a directory that left the source tree.
+void remove_watches_under(struct Monitor *m, const char *path) {
+  unwatch_under(m->notify_fd, &m->map, path);
+  remove_polled_under(&m->polled, path);
+}
+
+void drop_pending_move(struct Monitor *m, int idx) {
+  free(m->moves[idx].src_path);
+  m->moves[idx] = m->moves[--m->move_count];
+}
+
+// The other half of the move never came, so the entry left the watched tree.
+void resolve_move_out(struct Monitor *m, int idx) {
+  struct PendingMove *move = &m->moves[idx];
+  const char *rel = rel_path(m, move->src_path);
+
+  if (rel) {
+    remove_from_destinations(m, rel);
+  }
+  remove_dirty_under(&m->dirty, move->src_path);
+  if (move->is_dir) {
+    remove_watches_under(m, move->src_path);
+  }
+  drop_pending_move(m, idx);
+}
+
+void expire_moves(struct Monitor *m, int all) {
+  for (int i = m->move_count - 1; i >= 0; i--) {
+    if (all || ms_until(&m->moves[i].deadline) <= 0) {
+      resolve_move_out(m, i);
+    }
+  }
+}
+
+void add_pending_move(struct Monitor *m, uint32_t cookie, int is_dir,
+                      const char *src_path) {
+  if (m->move_count == MAX_PENDING_MOVES) {
+    int oldest = 0;
+    for (int i = 1; i < m->move_count; i++) {
+      if (ms_until(&m->moves[i].deadline) <
+          ms_until(&m->moves[oldest].deadline)) {
+        oldest = i;
+      }
+    }
+    resolve_move_out(m, oldest);
+  }
+
+  struct PendingMove *move = &m->moves[m->move_count++];
+  move->cookie = cookie;
+  move->is_dir = is_dir;
+  move->src_path = strdup(src_path);
+  deadline_after_ms(&move->deadline, MOVE_PAIR_TIMEOUT_MS);
+}
+
+void handle_moved_to(struct Monitor *m, uint32_t cookie, const char *src_path,
+                     const char *rel) {
+  for (int i = 0; i < m->move_count; i++) {
+    struct PendingMove *move = &m->moves[i];
+    if (move->cookie != cookie) {
+      continue;
+    }
+
+    if (move->is_dir) {
+      update_watch_paths(&m->map, move->src_path, src_path);
+      rename_polled(&m->polled, move->src_path, src_path);
+    }
+    rename_dirty(&m->dirty, move->src_path, src_path, m->opts.quiet_ms);
+    submit_work(m, WORK_MOVE, rel, rel_path(m, move->src_path));
+    drop_pending_move(m, i);
+    return;
+  }
+
+  // Moved in from outside the watched tree.
+  replicate_path(m, rel);
+}
+
+// Replicates one change to src_path; mask and cookie are in inotify
+// terms whichever backend saw the change.
+void handle_change(struct Monitor *m, uint32_t mask, uint32_t cookie,
+                   const char *src_path) {
+  const char *rel = rel_path(m, src_path);
+  int owner;
+  unsigned long long marker;
+  if (rel && (mask & IN_CREATE) &&
+      sscanf(rel, "/" SYNC_PREFIX "%d.%llu", &owner, &marker) == 2 &&
+      owner == m->status->owner) {
+    m->sync_marker = marker;
+    return;
+  }
+  // Temporary names of a restore in progress are published by a rename.
+  if (rel == NULL || is_meta_rel(rel) ||
+      is_temp_name(strrchr(src_path, '/') + 1)) {
+    return;
+  }
+
+  if (mask & IN_MOVED_FROM) {
+    add_pending_move(m, cookie, (mask & IN_ISDIR) != 0, src_path);
+  }
+
+  else if (mask & IN_MOVED_TO) {
+    handle_moved_to(m, cookie, src_path, rel);
+  }
+
+  else if (mask & IN_DELETE) {
+    remove_dirty_under(&m->dirty, src_path);
+    remove_polled_under(&m->polled, src_path);
+    remove_from_destinations(m, rel);
+  }
+
+  else if (mask & IN_CLOSE_WRITE) {
+    mark_dirty_ready(&m->dirty, src_path);
+  }
+
+  else if (mask & IN_MODIFY) {
+    mark_dirty(&m->dirty, src_path, m->opts.quiet_ms);
+  }
+
+  else if (mask & IN_CREATE) {
+    // New files are copied once the writer is done with them; directories,
+    // symlinks and new hard links right away so nothing created inside
+    // them is missed.
+    struct stat st;
+    if (!(mask & IN_ISDIR) && lstat(src_path, &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_nlink == 1) {
+      mark_dirty(&m->dirty, src_path, m->opts.quiet_ms);
+    } else {
+      replicate_path(m, rel);
+    }
+  }
+}
+
+// Returns -1 when the job should stop.
+int handle_event(struct Monitor *m, struct inotify_event *event) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    m->rescan_pending = 1;
+    return 0;
+  }
+
+  if ((event->mask & IN_IGNORED) || (event->mask & IN_DELETE_SELF)) {
+    if (event->wd == m->root_wd) {
+      return -1;
+    }
+
+    remove_from_map(&m->map, event->wd);
+
+    if (m->map.watch_count == 0) {
+      return -1;
+    }
+    return 0;
+  }
+
+  struct Watch *watch = find_watch(&m->map, event->wd);
+
+  if (!watch || event->len == 0) {
+    return 0;
+  }
+
+  char src_path[PATH_MAX];
+
+  snprintf(src_path, sizeof(src_path), "%s/%s", watch->path, event->name);
+  handle_change(m, event->mask, event->cookie, src_path);
+  return 0;
+}
+
+// Sets up the filesystem-wide backend: a single fanotify mark covers the
+// whole filesystem the source lives on, so large trees need no watch per
+// directory. Returns -1 when fanotify can't be used here, which is the
+// case without CAP_SYS_ADMIN or before Linux 5.17.
+int fanotify_start(struct Monitor *m) {
+  int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME_TARGET |
+                             FAN_CLOEXEC | FAN_NONBLOCK,
+                         O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_EVENTS,
+                    AT_FDCWD, m->src_base) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  m->mount_fd = open(m->src_base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (m->mount_fd < 0) {
+    close(fd);
+    return -1;
+  }
+  m->notify_fd = fd;
+  m->fanotify = 1;
+  return 0;
+}
+
+void forget_fanotify_dir(struct Monitor *m) {
+  free(m->fan_handle);
+  m->fan_handle = NULL;
+}
+
+void forget_fanotify_outside(struct Monitor *m) {
+  for (int i = 0; i < FAN_OUTSIDE_SLOTS; i++) {
+    free(m->fan_outside[i]);
+    m->fan_outside[i] = NULL;
+  }
+}
+
+struct file_handle *copy_handle(const struct file_handle *handle) {
+  size_t size = sizeof(*handle) + handle->handle_bytes;
+  struct file_handle *copy = malloc(size);
+  if (copy == NULL) {
+    ERR("malloc");
+  }
+  memcpy(copy, handle, size);
+  return copy;
+}
+
+// Resolves the directory handle of an event to its current path, or NULL
+// when it is gone or lies outside the source. Events come in runs from the
+// same directory, so the last answer is reused. The job's own writes to a
+// backup on the same filesystem come back as events as well; their
+// directories are remembered as outside and cost one lookup after that.
+const char *fanotify_dir_path(struct Monitor *m, struct file_handle *handle) {
+  size_t size = sizeof(*handle) + handle->handle_bytes;
+  if (m->fan_handle && memcmp(m->fan_handle, handle, size) == 0) {
+    return m->fan_path;
+  }
+  struct file_handle **outside =
+      &m->fan_outside[hash_bytes(14695981039346656037ULL,
+                                 (const unsigned char *)handle, size) %
+                      FAN_OUTSIDE_SLOTS];
+  if (*outside && memcmp(*outside, handle, size) == 0) {
+    return NULL;
+  }
+  forget_fanotify_dir(m);
+
+  // ESTALE once the directory is gone.
+  int fd = open_by_handle_at(m->mount_fd, handle, O_PATH | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  char link[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t len = readlink(link, m->fan_path, sizeof(m->fan_path) - 1);
+  close(fd);
+  if (len < 0) {
+    return NULL;
+  }
+  m->fan_path[len] = '\0';
+
+  const char *deleted = " (deleted)";
+  size_t deleted_len = strlen(deleted);
+  if ((size_t)len >= deleted_len &&
+      strcmp(m->fan_path + len - deleted_len, deleted) == 0) {
+    return NULL;
+  }
+
+  // The parent of the source still reports renames of the source itself.
+  if (!path_under(m->fan_path, m->src_base) &&
+      !path_under(m->src_base, m->fan_path)) {
+    free(*outside);
+    *outside = copy_handle(handle);
+    return NULL;
+  }
+
+  m->fan_handle = copy_handle(handle);
+  return m->fan_path;
+}
+
+// Translates one fanotify event into handle_change calls. Events on the
+// same name may have been merged into one mask; they are replayed in an
+// order that leaves the backup matching the source. Returns -1 when the
+// job should stop.
+int handle_fanotify_event(struct Monitor *m,
+                          const struct fanotify_event_metadata *event,
+                          char *record) {
+  if (event->mask & FAN_Q_OVERFLOW) {
+    m->rescan_pending = 1;
+    return 0;
+  }
+
+  // Slot 0 holds the only name of the event, or the old one of a rename.
+  char paths[2][PATH_MAX];
+  int have[2] = {0, 0};
+  char *info = record + event->metadata_len;
+  char *end = record + event->event_len;
+
+  while (info + sizeof(struct fanotify_event_info_header) <= end) {
+    struct fanotify_event_info_fid *fid =
+        (struct fanotify_event_info_fid *)info;
+    uint8_t type = fid->hdr.info_type;
+
+    if (type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+        type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME ||
+        type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME) {
+      int slot = type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME;
+      struct file_handle *handle = (struct file_handle *)fid->handle;
+      const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+      const char *dir = fanotify_dir_path(m, handle);
+
+      if (dir && strcmp(name, ".") != 0) {
+        snprintf(paths[slot], PATH_MAX, "%s/%s", dir, name);
+        have[slot] = path_under(paths[slot], m->src_base);
+      }
+    }
+    if (fid->hdr.len == 0) {
+      break;
+    }
+    info += fid->hdr.len;
+  }
+
+  if ((event->mask & FAN_ONDIR) && (event->mask & (FAN_RENAME | FAN_DELETE))) {
+    forget_fanotify_dir(m);
+    forget_fanotify_outside(m);
+  }
+
+  // The mark sees the source's own name only from its parent.
+  if (have[0] && strcmp(paths[0], m->src_base) == 0) {
+    return (event->mask & (FAN_RENAME | FAN_DELETE)) ? -1 : 0;
+  }
+  if (have[1] && strcmp(paths[1], m->src_base) == 0) {
+    return 0;
+  }
+
+  uint32_t is_dir = (event->mask & FAN_ONDIR) ? IN_ISDIR : 0;
+
+  if (event->mask & FAN_RENAME) {
+    // Both halves arrive together, so a cookie of our own pairs them.
+    uint32_t cookie = ++m->fan_cookie;
+    if (have[0]) {
+      handle_change(m, IN_MOVED_FROM | is_dir, cookie, paths[0]);
+    }
+    if (have[1]) {
+      handle_change(m, IN_MOVED_TO | is_dir, cookie, paths[1]);
+    }
+    return 0;
+  }
+
+  if (!have[0]) {
+    return 0;
+  }
+
+  struct stat st;
+  if (event->mask & FAN_DELETE) {
+    handle_change(m, IN_DELETE | is_dir, 0, paths[0]);
+    if (lstat(paths[0], &st) < 0) {
+      return 0;
+    }
+  }
+  if (event->mask & FAN_CREATE) {
+    handle_change(m, IN_CREATE | is_dir, 0, paths[0]);
+  }
+  if (event->mask & FAN_MODIFY) {
+    handle_change(m, IN_MODIFY, 0, paths[0]);
+  }
+  if (event->mask & FAN_CLOSE_WRITE) {
+    handle_change(m, IN_CLOSE_WRITE, 0, paths[0]);
+  }
+  return 0;
+}
+
+// Copies the dirty files whose quiet period is over, or all of them.
+void flush_dirty(struct Monitor *m, int all) {
+  struct DirtySet *set = &m->dirty;
+  struct timespec now;
+
+  if (set->count == 0) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!all && timespec_before(&now, &set->next_deadline)) {
+    return;
+  }
+
+  int due_count = 0;
+  char **due = malloc(set->count * sizeof(char *));
+  unsigned long long *first = malloc(set->count * sizeof(*first));
+  if (due == NULL || first == NULL) {
+    ERR("malloc");
+  }
+
+  int have_next = 0;
+  for (int i = 0; i < set->capacity; i++) {
+    struct DirtyPath *dirty = &set->paths[i];
+    if (dirty->path == NULL) {
+      continue;
+    }
+    if (all || !timespec_before(&now, &dirty->deadline)) {
+      first[due_count] = dirty->first.tv_sec * 1000000000ULL +
+                         dirty->first.tv_nsec;
+      due[due_count++] = strdup(dirty->path);
+    } else if (!have_next ||
+               timespec_before(&dirty->deadline, &set->next_deadline)) {
+      set->next_deadline = dirty->deadline;
+      have_next = 1;
+    }
+  }
+
+  for (int i = 0; i < due_count; i++) {
+    const char *rel = rel_path(m, due[i]);
+
+    remove_dirty(set, due[i]);
+    if (rel) {
+      // The copy is late by the quiet period since the first change.
+      m->event_ns = first[i];
+      submit_work(m, WORK_COPY_FILE, rel, NULL);
+    }
+    free(due[i]);
+  }
+  free(due);
+  free(first);
+}
+
+int monitor_timeout(struct Monitor *m) {
+  long timeout = -1;
+  for (int i = 0; i < m->move_count; i++) {
+    long left = ms_until(&m->moves[i].deadline);
+    if (timeout < 0 || left < timeout) {
+      timeout = left < 0 ? 0 : left;
+    }
+  }
+  if (m->dirty.count > 0) {
+    long left = ms_until(&m->dirty.next_deadline);
+    if (timeout < 0 || left < timeout) {
+      timeout = left < 0 ? 0 : left;
+    }
+  }
+  // The scan thread changes polled and retired while this runs.
+  pthread_mutex_lock(&m->watch_lock);
+  int polled = m->polled.count;
+  pthread_mutex_unlock(&m->watch_lock);
+  pthread_mutex_lock(&m->dsts_lock);
+  int retired = m->retired_count;
+  pthread_mutex_unlock(&m->dsts_lock);
+  if (polled > 0) {
+    long left = ms_until(&m->next_poll);
+    if (timeout < 0 || left < timeout) {
+      timeout = left < RESCAN_POLL_MS ? RESCAN_POLL_MS : left;
+    }
+  }
+  // Retired destinations are polled until their sync thread finishes, a
+  // queued rescan until the running one is done, and a running scan until
+  // it is, as it may leave subtrees to poll.
+  if ((retired > 0 || m->rescan_pending || atomic_load(&m->scan_running)) &&
+      (timeout < 0 || timeout > RESCAN_POLL_MS)) {
+    timeout = RESCAN_POLL_MS;
+  }
+  if (m->commit.mode != DURABILITY_OFF && !m->commit.started) {
+    long left = commit_left_ms(&m->commit);
+    if (left >= 0 && (timeout < 0 || left < timeout)) {
+      timeout = left;
+    }
+  }
+  return timeout;
+}
+
+struct Destination *new_destination(const char *path, const char *src,
+                                    const struct JobOptions *opts) {
+  struct Destination *dst = calloc(1, sizeof(struct Destination));
+  if (dst == NULL) {
+    ERR("calloc");
+  }
+  dst->path = strdup(path);
+  dst->src = src;
+  dst->threads = opts->threads;
+  dst->delta_threshold = opts->delta_threshold;
+  dst->manifest = manifest_open(path, opts->hash_files);
+  start_trash(dst);
+  return dst;
+}
+
+void free_destination(struct Destination *dst) {
+  if (dst->joinable) {
+    pthread_join(dst->sync_thread, NULL);
+  }
+  stop_trash(dst);
+  manifest_close(dst->manifest);
+  manifest_close(dst->dropped_manifest);
+  free(dst->path);
+  free(dst);
+}
+
+// While syncing is above zero a destination is copying whole trees. The
+// job counts such destinations, so sync can tell a backup still catching
+// up from one that is current.
+void begin_catch_up(struct Destination *dst) {
+  if (atomic_fetch_add(&dst->syncing, 1) == 0 && dst->status) {
+    atomic_fetch_add(&dst->status->catching_up, 1);
+  }
+}
+
+void end_catch_up(struct Destination *dst) {
+  if (atomic_fetch_sub(&dst->syncing, 1) == 1 && dst->status) {
+    atomic_fetch_sub(&dst->status->catching_up, 1);
+  }
+}
+
+void *sync_destination(void *arg) {
+  struct Destination *dst = arg;
+
+  copy_tree(dst->src, "", &dst, 1, dst->threads, NULL);
+  struct Manifest *manifest = dst->manifest;
+  if (manifest && manifest_sweep(manifest) < 0) {
+    drop_manifest(dst, manifest);
+  }
+  sweep_signatures(dst);
+  printf("[%d] Synced new destination %s -> %s\n", getpid(), dst->src,
+         dst->path);
+  fflush(stdout);
+  end_catch_up(dst);
+  return NULL;
+}
+
+void reap_retired(struct Monitor *m, int wait) {
+  pthread_mutex_lock(&m->dsts_lock);
+  for (int i = m->retired_count - 1; i >= 0; i--) {
+    struct Destination *dst = m->retired[i];
+    if (wait || !atomic_load(&dst->syncing)) {
+      free_destination(dst);
+      m->retired[i] = m->retired[--m->retired_count];
+    }
+  }
+  pthread_mutex_unlock(&m->dsts_lock);
+}
+
+void job_status_init(struct JobStatus *status, const struct JobOptions *opts) {
+  memset(status, 0, sizeof(*status));
+  status->owner = getpid();
+  status->durability = opts->durability;
+  rate_limit_init(&status->limit, opts->rate_bytes, opts->rate_ops);
+}
+
+// Where the backups of m record their changes, if they are made durable.
+struct Committer *monitor_committer(struct Monitor *m) {
+  return m->commit.mode != DURABILITY_OFF ? &m->commit : NULL;
+}
+
+// A new destination joins the fan-out at once, so events keep reaching it
+// while its sync thread copies the existing tree.
+void add_destination(struct Monitor *m, const char *path, int threads) {
+  for (int i = 0; i < m->dst_count; i++) {
+    if (strcmp(m->dsts[i]->path, path) == 0) {
+      return;
+    }
+  }
+  if (m->dst_count == MAX_DESTINATIONS) {
+    fprintf(stderr, "Too many destinations\n");
+    return;
+  }
+
+  struct Destination *dst = new_destination(path, m->src_base, &m->opts);
+  dst->threads = threads;
+  dst->committer = monitor_committer(m);
+  dst->status = m->status;
+  begin_catch_up(dst);
+  if (create_quiet_thread(&dst->sync_thread, sync_destination, dst) != 0) {
+    perror("pthread_create");
+    end_catch_up(dst);
+    free_destination(dst);
+    return;
+  }
+  dst->joinable = 1;
+  pthread_mutex_lock(&m->dsts_lock);
+  m->dsts[m->dst_count++] = dst;
+  pthread_mutex_unlock(&m->dsts_lock);
+}
+
+void remove_destination(struct Monitor *m, const char *path) {
+  for (int i = 0; i < m->dst_count; i++) {
+    struct Destination *dst = m->dsts[i];
+    if (strcmp(dst->path, path) != 0) {
+      continue;
+    }
+
+    pthread_mutex_lock(&m->dsts_lock);
+    memmove(&m->dsts[i], &m->dsts[i + 1],
+            (m->dst_count - i - 1) * sizeof(struct Destination *));
+    m->dst_count--;
+    int retire = atomic_load(&dst->syncing) > 0;
+    if (retire) {
+      m->retired[m->retired_count++] = dst;
+    }
+    pthread_mutex_unlock(&m->dsts_lock);
+
+    if (!retire) {
+      free_destination(dst);
+    }
+    return;
+  }
+}
+
+// Workers use the destination list as it is, so a destination is added
+// or removed by a step of its own, which the queue runs once the steps
+// before it are done; the reader goes on reading events meanwhile. Only
+// stopping the job waits for the queue here.
+void apply_control(struct Monitor *m, const struct ControlMessage *msg) {
+  // A change of the destinations is no event, its latency is not counted.
+  struct WorkItem step = {.rel = (char *)"", .old_rel = (char *)msg->path};
+  if (msg->op == 'A') {
+    step.op = WORK_ADD_DESTINATION;
+    step.threads = msg->threads;
+    submit_step(m, &step);
+  } else if (msg->op == 'R') {
+    step.op = WORK_REMOVE_DESTINATION;
+    submit_step(m, &step);
+  } else if (msg->op == 'S') {
+    work_wait_idle(&m->work);
+    while (m->dst_count > 0) {
+      remove_destination(m, m->dsts[m->dst_count - 1]->path);
+    }
+  }
+}
+
+// Returns -1 when the parent is gone or no destination is left.
+int handle_control(struct Monitor *m) {
+  struct ControlMessage msg;
+  ssize_t len = bulk_read(m->ctl_fd, (char *)&msg, sizeof(msg));
+
+  if (len != sizeof(msg)) {
+    return -1;
+  }
+  msg.path[PATH_MAX - 1] = '\0';
+
+  apply_control(m, &msg);
+  pthread_mutex_lock(&m->dsts_lock);
+  int dst_count = m->dst_count;
+  pthread_mutex_unlock(&m->dsts_lock);
+  return dst_count > 0 ? 0 : -1;
+}
+
+struct Monitor *monitor_new(const char *src, char **dsts, int dst_count,
+                            const struct JobOptions *opts,
+                            struct JobStatus *status) {
+  struct Monitor *m = calloc(1, sizeof(struct Monitor));
+  if (m == NULL) {
+    ERR("calloc");
+  }
+
+  m->src_base = strdup(src);
+  m->opts = *opts;
+  m->ctl_fd = -1;
+  m->notify_fd = -1;
+  m->mount_fd = -1;
+  pthread_mutex_init(&m->ctl_lock, NULL);
+  pthread_mutex_init(&m->dsts_lock, NULL);
+  pthread_mutex_init(&m->links_lock, NULL);
+  pthread_cond_init(&m->links_copied, NULL);
+  m->links.lock = &m->links_lock;
+  m->links.copied = &m->links_copied;
+  pthread_mutex_init(&m->watch_lock, NULL);
+  m->status = status;
+  if (status == NULL) {
+    job_status_init(&m->own_status, opts);
+    m->status = &m->own_status;
+  }
+  work_init(&m->work);
+  m->work.status = m->status;
+
+  m->commit.mode = opts->durability;
+  m->commit.window_ms = opts->commit_ms;
+  m->commit.window_bytes = opts->commit_bytes;
+  m->commit.work = &m->work;
+  m->commit.status = m->status;
+  pthread_mutex_init(&m->commit.lock, NULL);
+  pthread_cond_init(&m->commit.wake, NULL);
+
+  if (opts->trace_entries > 0) {
+    unsigned int capacity = 1;
+    while (capacity < (unsigned int)opts->trace_entries) {
+      capacity *= 2;
+    }
+    m->trace = calloc(1, sizeof(struct Trace) +
+                             capacity * sizeof(struct TraceRecord));
+    if (m->trace == NULL) {
+      ERR("calloc");
+    }
+    m->trace->capacity = capacity;
+  }
+
+  for (int i = 0; i < dst_count; i++) {
+    // The initial destinations are synced by monitor_start, not by their
+    // own thread.
+    m->dsts[m->dst_count++] = new_destination(dsts[i], NULL, opts);
+    m->dsts[i]->committer = monitor_committer(m);
+    m->dsts[i]->status = m->status;
+  }
+  return m;
+}
+
+// Tells how the tree is watched whenever subtrees move between inotify
+// and polling.
+void report_watch_mode(struct Monitor *m) {
+  if (m->reported_polled == m->polled.count) {
+    return;
+  }
+  m->reported_polled = m->polled.count;
+  printf("[%d] %s: %d directories event-driven, %d subtrees polled\n",
+         getpid(), m->src_base, m->map.watch_count, m->polled.count);
+  fflush(stdout);
+}
+
+void *scan_work(void *arg) {
+  struct Monitor *m = arg;
+
+  // Directories created before the job started, or while events were
+  // lost, get their watches before the scan looks into them. A polled
+  // subtree tries again to get watches, without taking any from others.
+  if (m->scan_kind == SCAN_POLL) {
+    for (int i = 0; i < m->scan_rel_count; i++) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s%s", m->src_base, m->scan_rels[i]);
+      add_watch_recursive(m->notify_fd, &m->map, &m->polled, 0, path,
+                          &m->watch_lock);
+    }
+  } else if (!m->fanotify) {
+    add_watch_recursive(m->notify_fd, &m->map, &m->polled, 1, m->src_base,
+                        &m->watch_lock);
+  }
+  if (!m->fanotify) {
+    pthread_mutex_lock(&m->watch_lock);
+    report_watch_mode(m);
+    pthread_mutex_unlock(&m->watch_lock);
+  }
+  for (int i = 0; i < m->scan_rel_count; i++) {
+    copy_tree(m->src_base, m->scan_rels[i], m->scan_dsts, m->scan_dst_count,
+              m->opts.threads,
+              m->scan_kind == SCAN_INITIAL ? &m->links : NULL);
+  }
+  if (m->scan_kind == SCAN_INITIAL) {
+    for (int i = 0; i < m->scan_dst_count; i++) {
+      struct Manifest *manifest = m->scan_dsts[i]->manifest;
+      if (manifest && manifest_sweep(manifest) < 0) {
+        drop_manifest(m->scan_dsts[i], manifest);
+      }
+      sweep_signatures(m->scan_dsts[i]);
+    }
+  }
+  for (int i = 0; i < m->scan_dst_count; i++) {
+    end_catch_up(m->scan_dsts[i]);
+  }
+  if (m->scan_kind == SCAN_INITIAL) {
+    print_copy_stats("Initial sync", m->src_base);
+  } else if (m->scan_kind == SCAN_RECONCILE) {
+    print_copy_stats("Rescanned", m->src_base);
+  }
+  atomic_store(&m->scan_running, 0);
+  return NULL;
+}
+
+void finish_scan(struct Monitor *m) {
+  if (m->scan_joinable) {
+    pthread_join(m->scan_thread, NULL);
+    m->scan_joinable = 0;
+  }
+  for (int i = 0; i < m->scan_rel_count; i++) {
+    free(m->scan_rels[i]);
+  }
+  free(m->scan_rels);
+  m->scan_rels = NULL;
+  m->scan_rel_count = 0;
+}
+
+// Runs copy_tree over the given source paths in the background. Returns
+// -1 when no thread could be started; rels are owned by the scan either
+// way.
+int start_scan(struct Monitor *m, char **rels, int rel_count,
+               enum ScanKind kind) {
+  finish_scan(m);
+  m->scan_rels = rels;
+  m->scan_rel_count = rel_count;
+  m->scan_kind = kind;
+
+  pthread_mutex_lock(&m->dsts_lock);
+  m->scan_dst_count = m->dst_count;
+  for (int i = 0; i < m->dst_count; i++) {
+    m->scan_dsts[i] = m->dsts[i];
+    begin_catch_up(m->dsts[i]);
+  }
+  pthread_mutex_unlock(&m->dsts_lock);
+
+  atomic_store(&m->scan_running, 1);
+  if (create_quiet_thread(&m->scan_thread, scan_work, m) != 0) {
+    perror("pthread_create");
+    for (int i = 0; i < m->scan_dst_count; i++) {
+      end_catch_up(m->scan_dsts[i]);
+    }
+    atomic_store(&m->scan_running, 0);
+    return -1;
+  }
+  m->scan_joinable = 1;
+  return 0;
+}
+
+// Starts watching the source, then copies the tree to the initial
+// destinations in the background, so the job reads events from the start
+// and a large tree never holds up the thread running the job.
+int monitor_start(struct Monitor *m) {
+  int src_fd = open_dir_at(AT_FDCWD, m->src_base);
+  if (src_fd < 0) {
+    perror("opendir");
+    return -1;
+  }
+  TEMP_FAILURE_RETRY(close(src_fd));
+
+  if (monitor_committer(m) && !m->in_loop) {
+    start_committer(&m->commit);
+  }
+  if (!m->in_loop) {
+    start_workers(m);
+  }
+
+  if (!m->opts.inotify_only && fanotify_start(m) == 0) {
+    printf("[%d] %s: watching the whole filesystem with fanotify\n", getpid(),
+           m->src_base);
+    fflush(stdout);
+  } else {
+    m->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m->notify_fd < 0) {
+      perror("inotify_init1");
+      return -1;
+    }
+    // The directories below are watched by the initial scan.
+    m->root_wd = watch_dir(m->notify_fd, &m->map, &m->polled, 1, m->src_base);
+    deadline_after_ms(&m->next_poll, m->opts.poll_ms);
+  }
+
+  char **rels = malloc(sizeof(char *));
+  if (rels == NULL) {
+    ERR("malloc");
+  }
+  rels[0] = strdup("");
+  return start_scan(m, rels, 1, SCAN_INITIAL);
+}
+
+// Events were dropped: let a background scan watch whatever directories
+// appeared unseen and bring the backups in line while events keep being
+// handled. An overflow during the scan queues another one.
+void start_rescan(struct Monitor *m) {
+  if (!m->rescan_pending || atomic_load(&m->scan_running)) {
+    return;
+  }
+
+  fprintf(stderr, "[%d] events were lost, rescanning %s\n", getpid(),
+          m->src_base);
+  m->rescan_pending = 0;
+
+  char **rels = malloc(sizeof(char *));
+  if (rels == NULL) {
+    ERR("malloc");
+  }
+  rels[0] = strdup("");
+  if (start_scan(m, rels, 1, SCAN_RECONCILE) < 0) {
+    m->rescan_pending = 1;
+  }
+}
+
+// Tries to watch the polled subtrees again, then scans all of them once
+// more: the promoted ones may have changed while nobody was looking.
+void poll_subtrees(struct Monitor *m) {
+  if (m->polled.count == 0 || ms_until(&m->next_poll) > 0 ||
+      atomic_load(&m->scan_running)) {
+    return;
+  }
+  deadline_after_ms(&m->next_poll, m->opts.poll_ms);
+
+  struct PollList was = m->polled;
+  char **rels = malloc(was.count * sizeof(char *));
+  int rel_count = 0;
+
+  if (rels == NULL) {
+    ERR("malloc");
+  }
+  memset(&m->polled, 0, sizeof(m->polled));
+
+  for (int i = 0; i < was.count; i++) {
+    struct stat st;
+    if (lstat(was.paths[i], &st) < 0 || !S_ISDIR(st.st_mode)) {
+      continue;
+    }
+    rels[rel_count++] = strdup(rel_path(m, was.paths[i]));
+  }
+
+  // The scan watches the subtrees again before it copies them. Without a
+  // scan they stay polled.
+  if (start_scan(m, rels, rel_count, SCAN_POLL) < 0) {
+    m->polled = was;
+    return;
+  }
+  free_polled(&was);
+}
+int read_inotify_events(struct Monitor *m) {
+  char buffer[EVENT_BUF_LEN];
+  ssize_t len = read(m->notify_fd, buffer, EVENT_BUF_LEN);
+
+  if (len < 0 && errno != EAGAIN && errno != EINTR) {
+    perror("read");
     return -1;
   }
 
-  struct stat st;
-  if (fstat(f_src, &st) < 0) {
-    TEMP_FAILURE_RETRY(close(f_src));
-    perror("fstat\n");
-    return -1;
+  m->event_ns = monotonic_ns();
+  ssize_t i = 0;
+  while (i < len) {
+    struct inotify_event *event = (struct inotify_event *)&buffer[i];
+
+    atomic_fetch_add_explicit(&m->status->events, 1, memory_order_relaxed);
+    if (handle_event(m, event) < 0) {
+      return -1;
+    }
+    i += sizeof(struct inotify_event) + event->len;
   }
+  return 0;
+}
 
-  int f_dst = TEMP_FAILURE_RETRY(open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode));
+int read_fanotify_events(struct Monitor *m) {
+  char buffer[EVENT_BUF_LEN];
+  ssize_t len = read(m->notify_fd, buffer, EVENT_BUF_LEN);
 
-  if (f_dst == -1) {
-    TEMP_FAILURE_RETRY(close(f_src));
-    perror("open\n");
+  if (len < 0 && errno != EAGAIN && errno != EINTR) {
+    perror("read");
     return -1;
   }
 
-  char buf[COPY_BUF_SIZE];
-  ssize_t bytes_read;
-  int result = 0;
-
-  while ((bytes_read = bulk_read(f_src, buf, sizeof(buf))) > 0) {
-    if (bulk_write(f_dst, buf, bytes_read) != bytes_read) {
-      result = -1;
-      perror("bulk_write\n");
+  m->event_ns = monotonic_ns();
+  ssize_t i = 0;
+  while (i + (ssize_t)FAN_EVENT_METADATA_LEN <= len) {
+    // Records are only 4-byte aligned, the metadata wants 8.
+    struct fanotify_event_metadata event;
+    memcpy(&event, &buffer[i], sizeof(event));
+
+    if (event.vers != FANOTIFY_METADATA_VERSION) {
+      fprintf(stderr, "fanotify: unexpected metadata version %d\n",
+              event.vers);
+      return -1;
+    }
+    if (event.event_len < FAN_EVENT_METADATA_LEN || i + event.event_len > len) {
       break;
     }
+    atomic_fetch_add_explicit(&m->status->events, 1, memory_order_relaxed);
+    if (handle_fanotify_event(m, &event, &buffer[i]) < 0) {
+      return -1;
+    }
+    i += event.event_len;
   }
-  if (bytes_read < 0) {
-    result = -1;
-  }
-
-  if (result == 0) {
-    struct timespec times[2];
-    times[0] = st.st_atim;
-    times[1] = st.st_mtim;
+  return 0;
+}
 
-    if (futimens(f_dst, times) < 0) {
-      result = -1;
-    }
+// Every change made before the sync marker was read by now. What still
+// waits for its quiet period or its other half is queued at once, and the
+// parent learns which step finishes the sync.
+void pass_sync_marker(struct Monitor *m) {
+  expire_moves(m, 1);
+  flush_dirty(m, 1);
+
+  pthread_mutex_lock(&m->work.lock);
+  atomic_store(&m->status->sync_seq, m->work.next_seq - 1);
+  pthread_mutex_unlock(&m->work.lock);
+  atomic_store(&m->status->sync_marker, m->sync_marker);
+  m->sync_marker = 0;
+}
 
-    if (fchmod(f_dst, mode) < 0) {
-      perror("fchmod");
-      result = -1;
-    }
+int monitor_step_locked(struct Monitor *m) {
+  int res = m->fanotify ? read_fanotify_events(m) : read_inotify_events(m);
+  if (res < 0) {
+    return -1;
+  }
+  if (m->sync_marker) {
+    pass_sync_marker(m);
   }
 
-  TEMP_FAILURE_RETRY(close(f_src));
-  TEMP_FAILURE_RETRY(close(f_dst));
-  return result;
+  expire_moves(m, 0);
+  flush_dirty(m, 0);
+  report_work_depth(m);
+  atomic_store(&m->status->dirty_files, m->dirty.count);
+  atomic_store(&m->status->fanotify, m->fanotify);
+  atomic_store(&m->status->watches, m->map.watch_count);
+  atomic_store(&m->status->polled, m->polled.count);
+  start_rescan(m);
+  atomic_store(&m->status->rescan_pending, m->rescan_pending);
+  poll_subtrees(m);
+  reap_retired(m, 0);
+  if (monitor_committer(m) && !m->commit.started) {
+    commit_due(&m->commit, 0);
+  }
+  return 0;
 }
 
-int copy_recursive(const char *src_base, const char *dst_base,
-                   const char *root_src, const char *root_dst) {
-  DIR *d;
-  struct dirent *entry;
-  struct stat st;
+// Handles one batch of events, if there is one, and the timers. Returns
+// -1 when the job is over.
+int monitor_step(struct Monitor *m) {
+  pthread_mutex_lock(&m->watch_lock);
+  int res = monitor_step_locked(m);
+  pthread_mutex_unlock(&m->watch_lock);
+  return res;
+}
 
-  if (lstat(src_base, &st) < 0) {
-    perror("lstat\n");
-    return -1;
+// Settles pending moves and dirty files and lets go of every destination.
+void monitor_stop(struct Monitor *m) {
+  finish_scan(m);
+  expire_moves(m, 1);
+  flush_dirty(m, 1);
+  work_close(&m->work);
+  stop_committer(&m->commit);
+  if (m->notify_fd >= 0) {
+    close(m->notify_fd);
+    m->notify_fd = -1;
   }
-
-  if (TEMP_FAILURE_RETRY(mkdir(dst_base, st.st_mode)) < 0 && errno != EEXIST) {
-    perror("mkdir\n");
-    return -1;
+  if (m->mount_fd >= 0) {
+    close(m->mount_fd);
+    m->mount_fd = -1;
   }
+  forget_fanotify_dir(m);
+  forget_fanotify_outside(m);
+  free_map(&m->map);
+  free_dirty(&m->dirty);
+  free_links(&m->links);
+  free_polled(&m->polled);
+
+  reap_retired(m, 1);
+  while (m->dst_count > 0) {
+    remove_destination(m, m->dsts[m->dst_count - 1]->path);
+  }
+  reap_retired(m, 1);
+}
 
-  if ((d = opendir(src_base)) == NULL) {
-    perror("opendir\n");
-    return -1;
+void monitor_free(struct Monitor *m) {
+  pthread_mutex_destroy(&m->ctl_lock);
+  pthread_mutex_destroy(&m->dsts_lock);
+  pthread_mutex_destroy(&m->links_lock);
+  pthread_cond_destroy(&m->links_copied);
+  pthread_mutex_destroy(&m->watch_lock);
+  work_destroy(&m->work);
+  pthread_mutex_destroy(&m->commit.lock);
+  pthread_cond_destroy(&m->commit.wake);
+  if (m->status == &m->own_status) {
+    pthread_mutex_destroy(&m->own_status.limit.lock);
   }
+  free(m->trace);
+  free(m->ctl_msgs);
+  free(m->src_base);
+  free(m);
+}
 
-  while ((entry = readdir(d)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
+void monitor(struct Monitor *m) {
+  while (keep_running) {
+    if (dump_trace) {
+      dump_trace = 0;
+      write_trace(m);
     }
 
-    char src_path[PATH_MAX];
-    char dst_path[PATH_MAX];
-
-    snprintf(src_path, sizeof(src_path), "%s/%s", src_base, entry->d_name);
-    snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_base, entry->d_name);
-
-    struct stat entry_st;
+    struct pollfd pfds[2] = {{.fd = m->notify_fd, .events = POLLIN},
+                             {.fd = m->ctl_fd, .events = POLLIN}};
+    int ready = poll(pfds, 2, monitor_timeout(m));
 
-    if (lstat(src_path, &entry_st) < 0) {
-      perror("lstat\n");
-      continue;
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
     }
 
-    if (S_ISDIR(entry_st.st_mode)) {
-      copy_recursive(src_path, dst_path, root_src, root_dst);
+    if (pfds[1].revents & (POLLIN | POLLHUP)) {
+      if (handle_control(m) < 0) {
+        break;
+      }
     }
 
-    else if (S_ISREG(entry_st.st_mode)) {
-      copy_file_data(src_path, dst_path, entry_st.st_mode);
+    if (monitor_step(m) < 0) {
+      break;
     }
+  }
+}
 
-    else if (S_ISLNK(entry_st.st_mode)) {
-      char target[PATH_MAX];
-      ssize_t len =
-          TEMP_FAILURE_RETRY(readlink(src_path, target, sizeof(target) - 1));
-      if (len != -1) {
-        target[len] = '\0';
-        unlink(dst_path);
+void child_work(const char *src, char **dsts, int dst_count,
+                const struct JobOptions *opts, int ctl_fd,
+                struct JobStatus *status) {
+  sethandler(sigterm_handler, SIGTERM);
+  sethandler(SIG_IGN, SIGINT);
+  // The parent blocks SIGUSR1, the job dumps its trace on it.
+  sethandler(trace_handler, SIGUSR1);
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
 
-        if (strncmp(target, root_src, strlen(root_src)) == 0) {
-          char new_target[PATH_MAX];
-          snprintf(new_target, sizeof(new_target), "%s%s", root_dst,
-                   target + strlen(root_src));
-          TEMP_FAILURE_RETRY(symlink(new_target, dst_path));
-        }
+  struct Monitor *m = monitor_new(src, dsts, dst_count, opts, status);
+  m->ctl_fd = ctl_fd;
 
-        else {
-          TEMP_FAILURE_RETRY(symlink(target, dst_path));
-        }
-      }
-    }
+  if (monitor_start(m) != 0) {
+    exit(EXIT_FAILURE);
   }
 
-  if (closedir(d)) {
-    ERR("closedir");
+  monitor(m);
+  monitor_stop(m);
+  print_copy_stats("Stopped", src);
+
+  monitor_free(m);
+  close(ctl_fd);
+
+  exit(EXIT_SUCCESS);
+}
+
+struct Job *find_job(const char *src) {
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].pid != 0 && strcmp(jobs[i].src, src) == 0) {
+      return &jobs[i];
+    }
   }
+  return NULL;
+}
 
-  return 0;
+int find_job_dst(const struct Job *job, const char *dst) {
+  for (int i = 0; job && i < job->dst_count; i++) {
+    if (strcmp(job->dsts[i], dst) == 0) {
+      return i;
+    }
+  }
+  return -1;
 }
 
-int remove_recursive(const char *path) {
-  struct stat st;
-  DIR *d;
+// Event-loop mode: every job is a Monitor in this process. The loop thread
+// multiplexes stdin and the jobs' inotify fds with epoll and hands ready
+// jobs to a small pool of copier threads. A job is run by at most one
+// copier at a time, so its events stay in order. The copiers also do the
+// jobs' replication steps and commits, and one thread empties the trash of
+// every destination, so the thread count does not grow with the jobs.
+struct EventLoop {
+  int epoll_fd;
+  int wake_fd;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  struct Monitor *ready[MAX_JOBS];
+  int ready_head;
+  int ready_count;
+  struct Monitor *done[MAX_JOBS];
+  int done_count;
+  int closed;
+  pthread_t copiers[MAX_COPY_THREADS];
+  int copier_count;
+  struct Monitor *monitors[MAX_JOBS];
+  int monitor_count;
+};
 
-  if (lstat(path, &st) < 0) {
-    perror("lstat\n");
-    return -1;
+struct EventLoop *loop = NULL;
+
+void loop_dispatch(struct Monitor *m) {
+  m->loop_busy = 1;
+  m->loop_kick = 0;
+  pthread_mutex_lock(&loop->lock);
+  loop->ready[(loop->ready_head + loop->ready_count) % MAX_JOBS] = m;
+  loop->ready_count++;
+  pthread_cond_signal(&loop->not_empty);
+  pthread_mutex_unlock(&loop->lock);
+}
+
+// Queues a control message for a job; it is applied by the copier that
+// runs the job next.
+void loop_post(struct Monitor *m, const struct ControlMessage *msg) {
+  pthread_mutex_lock(&m->ctl_lock);
+  struct ControlMessage *msgs =
+      realloc(m->ctl_msgs, (m->ctl_count + 1) * sizeof(struct ControlMessage));
+  if (msgs == NULL) {
+    ERR("realloc");
   }
+  m->ctl_msgs = msgs;
+  m->ctl_msgs[m->ctl_count++] = *msg;
+  pthread_mutex_unlock(&m->ctl_lock);
+
+  if (m->loop_busy) {
+    m->loop_kick = 1;
+  } else {
+    loop_dispatch(m);
+  }
+}
 
-  if (!S_ISDIR(st.st_mode)) {
-    return unlink(path);
+// Runs one step of a job on a copier thread. Returns -1 when it ended.
+int loop_run_job(struct Monitor *m) {
+  pthread_mutex_lock(&m->ctl_lock);
+  struct ControlMessage *msgs = m->ctl_msgs;
+  int count = m->ctl_count;
+  m->ctl_msgs = NULL;
+  m->ctl_count = 0;
+  pthread_mutex_unlock(&m->ctl_lock);
+
+  for (int i = 0; i < count; i++) {
+    apply_control(m, &msgs[i]);
   }
+  free(msgs);
 
-  if ((d = opendir(path)) == NULL) {
-    perror("opendir\n");
+  if (m->dst_count == 0) {
     return -1;
   }
+  if (!m->started) {
+    m->started = 1;
+    if (monitor_start(m) < 0) {
+      return -1;
+    }
+  }
+  return monitor_step(m);
+}
 
-  struct dirent *entry;
-  while ((entry = readdir(d)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
+void *loop_copier(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&loop->lock);
+    while (loop->ready_count == 0 && !loop->closed) {
+      pthread_cond_wait(&loop->not_empty, &loop->lock);
+    }
+    if (loop->ready_count == 0) {
+      pthread_mutex_unlock(&loop->lock);
+      return NULL;
+    }
+    struct Monitor *m = loop->ready[loop->ready_head];
+    loop->ready_head = (loop->ready_head + 1) % MAX_JOBS;
+    loop->ready_count--;
+    pthread_mutex_unlock(&loop->lock);
+
+    int ended = loop_run_job(m) < 0;
+    if (ended) {
+      monitor_stop(m);
     }
 
-    char child_path[PATH_MAX];
-    snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
-    remove_recursive(child_path);
-  }
+    pthread_mutex_lock(&loop->lock);
+    m->loop_ended = ended;
+    loop->done[loop->done_count++] = m;
+    pthread_mutex_unlock(&loop->lock);
 
-  if (closedir(d)) {
-    ERR("closedir");
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+      perror("write eventfd");
+    }
   }
-
-  return rmdir(path);
 }
 
-void monitor(const char *src_base, const char *dst_base) {
-  int notify_fd = inotify_init();
+void loop_init(int copiers) {
+  loop = calloc(1, sizeof(struct EventLoop));
+  if (loop == NULL) {
+    ERR("calloc");
+  }
+  pthread_mutex_init(&loop->lock, NULL);
+  pthread_cond_init(&loop->not_empty, NULL);
 
-  if (notify_fd < 0) {
-    exit(EXIT_FAILURE);
+  if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    ERR("epoll_create1");
+  }
+  if ((loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    ERR("eventfd");
   }
 
-  struct WatchMap map = {0};
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = loop};
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+    ERR("epoll_ctl");
+  }
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0) {
+    ERR("epoll_ctl");
+  }
 
-  add_watch_recursive(notify_fd, &map, src_base);
+  start_shared_trash();
 
-  int root_wd = -1;
-  if (map.watch_count > 0) {
-    root_wd = map.watch_map[0].wd;
+  // Signals are for the loop thread only.
+  sigset_t mask, old_mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+  for (; loop->copier_count < copiers; loop->copier_count++) {
+    if (pthread_create(&loop->copiers[loop->copier_count], NULL, loop_copier,
+                       NULL) != 0) {
+      ERR("pthread_create");
+    }
   }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
 
-  uint32_t pending_cookie = 0;
-  char pending_move_path[PATH_MAX] = "";
-  char buffer[EVENT_BUF_LEN];
-
-  while (keep_running) {
-    ssize_t len = read(notify_fd, buffer, EVENT_BUF_LEN);
+// Returns -1 when the loop is full: jobs that were stopped but not yet
+// collected still hold their place.
+int loop_add_monitor(struct Monitor *m) {
+  if (loop->monitor_count == MAX_JOBS) {
+    return -1;
+  }
+  loop->monitors[loop->monitor_count++] = m;
+  loop_dispatch(m);
+  return 0;
+}
 
-    if (len < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
+void loop_remove_monitor(struct Monitor *m) {
+  for (int i = 0; i < loop->monitor_count; i++) {
+    if (loop->monitors[i] == m) {
+      loop->monitors[i] = loop->monitors[--loop->monitor_count];
       break;
     }
+  }
+}
 
-    ssize_t i = 0;
-    while (i < len) {
-      struct inotify_event *event = (struct inotify_event *)&buffer[i];
-
-      if ((event->mask & IN_IGNORED) || (event->mask & IN_DELETE_SELF)) {
-        if (event->wd == root_wd) {
-          keep_running = 0;
-          break;
-        }
+void forget_job(struct Job *job);
 
-        remove_from_map(&map, event->wd);
+// Takes back the jobs the copiers are done with.
+void loop_collect() {
+  uint64_t value;
+  if (read(loop->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    perror("read eventfd");
+  }
 
-        if (map.watch_count == 0) {
-          keep_running = 0;
+  struct Monitor *done[MAX_JOBS];
+  pthread_mutex_lock(&loop->lock);
+  int done_count = loop->done_count;
+  memcpy(done, loop->done, done_count * sizeof(struct Monitor *));
+  loop->done_count = 0;
+  pthread_mutex_unlock(&loop->lock);
+
+  for (int i = 0; i < done_count; i++) {
+    struct Monitor *m = done[i];
+    m->loop_busy = 0;
+
+    if (m->loop_ended) {
+      for (int j = 0; j < MAX_JOBS; j++) {
+        if (jobs[j].monitor == m) {
+          printf("Job %s finished\n", jobs[j].src);
+          forget_job(&jobs[j]);
         }
-
-        i += sizeof(struct inotify_event) + event->len;
-        continue;
       }
+      loop_remove_monitor(m);
+      monitor_free(m);
+      continue;
+    }
 
-      struct Watch *watch = find_watch(&map, event->wd);
+    if (m->notify_fd >= 0) {
+      struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT,
+                               .data.ptr = m};
+      int op = m->loop_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+      if (epoll_ctl(loop->epoll_fd, op, m->notify_fd, &ev) < 0) {
+        perror("epoll_ctl");
+      }
+      m->loop_registered = 1;
+    }
+    if (m->loop_kick) {
+      loop_dispatch(m);
+    }
+  }
+}
 
-      if (watch && event->len > 0) {
-        char src_path[PATH_MAX];
-        char dst_path[PATH_MAX];
+// The nearest timer of the idle jobs; due jobs are dispatched right away.
+int loop_timeout() {
+  int timeout = -1;
+  for (int i = 0; i < loop->monitor_count; i++) {
+    struct Monitor *m = loop->monitors[i];
+    if (m->loop_busy || !m->started) {
+      continue;
+    }
+    int left = monitor_timeout(m);
+    if (left == 0) {
+      loop_dispatch(m);
+    } else if (left > 0 && (timeout < 0 || left < timeout)) {
+      timeout = left;
+    }
+  }
+  return timeout;
+}
 
-        snprintf(src_path, sizeof(src_path), "%s/%s", watch->path, event->name);
+// Stops or resumes reading commands, while a sync holds them back. stdin
+// leaves the epoll set, as a hangup is reported whatever the event mask.
+void loop_watch_stdin(int watch) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(loop->epoll_fd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                STDIN_FILENO, &ev) < 0) {
+    perror("epoll_ctl");
+  }
+}
 
-        if (strncmp(src_path, src_base, strlen(src_base)) == 0) {
-          const char *rel_path = src_path + strlen(src_base);
-          snprintf(dst_path, sizeof(dst_path), "%s%s", dst_base, rel_path);
+void loop_shutdown() {
+  // Wait for the copiers to hand every job back.
+  for (;;) {
+    int busy = 0;
+    for (int i = 0; i < loop->monitor_count; i++) {
+      busy |= loop->monitors[i]->loop_busy;
+    }
+    if (!busy) {
+      break;
+    }
+    struct pollfd pfd = {.fd = loop->wake_fd, .events = POLLIN};
+    if (poll(&pfd, 1, -1) > 0) {
+      loop_collect();
+    }
+  }
 
-          if (event->mask & IN_MOVED_FROM) {
-            pending_cookie = event->cookie;
-            strncpy(pending_move_path, src_path, sizeof(pending_move_path));
+  pthread_mutex_lock(&loop->lock);
+  loop->closed = 1;
+  pthread_cond_broadcast(&loop->not_empty);
+  pthread_mutex_unlock(&loop->lock);
+  for (int i = 0; i < loop->copier_count; i++) {
+    pthread_join(loop->copiers[i], NULL);
+  }
 
-            remove_recursive(dst_path);
-          }
+  while (loop->monitor_count > 0) {
+    struct Monitor *m = loop->monitors[--loop->monitor_count];
+    monitor_stop(m);
+    monitor_free(m);
+  }
+  stop_shared_trash();
+
+  close(loop->epoll_fd);
+  close(loop->wake_fd);
+  pthread_mutex_destroy(&loop->lock);
+  pthread_cond_destroy(&loop->not_empty);
+  free(loop);
+  loop = NULL;
+}
 
-          else if (event->mask & IN_MOVED_TO) {
-            if (event->cookie == pending_cookie && pending_cookie != 0) {
-              update_watch_paths(&map, pending_move_path, src_path);
-              pending_cookie = 0;
-            }
-
-            struct stat st;
-            if (lstat(src_path, &st) == 0) {
-              if (S_ISDIR(st.st_mode)) {
-                copy_recursive(src_path, dst_path, src_base, dst_base);
-                add_watch_recursive(notify_fd, &map, src_path);
-              } else if (S_ISREG(st.st_mode)) {
-                copy_file_data(src_path, dst_path, st.st_mode);
-              }
-              else if (S_ISLNK(st.st_mode)) {
-                char target[PATH_MAX];
-                ssize_t l = readlink(src_path, target, sizeof(target) - 1);
-                if (l != -1) {
-                  target[l] = '\0';
-                  unlink(dst_path);
-                  
-                  if (strncmp(target, src_base, strlen(src_base)) == 0) {
-                    char new_target[PATH_MAX];
-                    snprintf(new_target, sizeof(new_target), "%s%s", dst_base,
-                             target + strlen(src_base));
-                    symlink(new_target, dst_path);
-                  } 
-                  
-                  else {
-                    symlink(target, dst_path);
-                  }
-                }
-              }
-            }
-          }
+int send_control(struct Job *job, char op, const char *path, int threads) {
+  struct ControlMessage msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.op = op;
+  msg.threads = threads;
+  strncpy(msg.path, path, PATH_MAX - 1);
 
-          else if (event->mask & IN_DELETE) {
-            remove_recursive(dst_path);
-          }
+  if (job->monitor) {
+    loop_post(job->monitor, &msg);
+    return 0;
+  }
 
-          else if (event->mask & (IN_CREATE | IN_MODIFY | IN_ATTRIB)) {
-            struct stat st;
-
-            if (lstat(src_path, &st) == 0) {
-              if (S_ISDIR(st.st_mode)) {
-                copy_recursive(src_path, dst_path, src_base, dst_base);
-                add_watch_recursive(notify_fd, &map, src_path);
-              }
-
-              else if (S_ISREG(st.st_mode)) {
-                copy_file_data(src_path, dst_path, st.st_mode);
-              }
-
-              else if (S_ISLNK(st.st_mode)) {
-                char target[PATH_MAX];
-                ssize_t l = readlink(src_path, target, sizeof(target) - 1);
-                if (l != -1) {
-                   target[l] = '\0';
-                   unlink(dst_path);
-                  
-                   if (strncmp(target, src_base, strlen(src_base)) == 0) {
-                     char new_target[PATH_MAX];
-                     snprintf(new_target, sizeof(new_target), "%s%s", dst_base,
-                              target + strlen(src_base));
-                     symlink(new_target, dst_path);
-                   }
-
-                   else {
-                     symlink(target, dst_path);
-                   }
-                }
-              }
-            }
-          }
-        }
-      }
-      i += sizeof(struct inotify_event) + event->len;
-    }
+  if (bulk_write(job->ctl_fd, (char *)&msg, sizeof(msg)) != sizeof(msg)) {
+    perror("write control");
+    return -1;
   }
+  return 0;
+}
 
-  close(notify_fd);
-  for (int k = 0; k < map.watch_count; k++) {
-    free(map.watch_map[k].path);
+void forget_job(struct Job *job) {
+  if (job->ctl_fd >= 0) {
+    close(job->ctl_fd);
+  }
+  for (int i = 0; i < job->dst_count; i++) {
+    free(job->dsts[i]);
+  }
+  // The status of a loop job lives in its monitor.
+  if (job->status && job->monitor == NULL) {
+    munmap(job->status, sizeof(struct JobStatus));
   }
+  job->pid = 0;
+  job->ctl_fd = -1;
+  job->monitor = NULL;
+  job->status = NULL;
+  job->dst_count = 0;
 }
 
-void child_work(const char *src, const char *dst) {
-  sethandler(sigterm_handler, SIGTERM);
-  sethandler(SIG_IGN, SIGINT);
+void stop_job(struct Job *job) {
+  if (job->monitor) {
+    send_control(job, 'S', "", 0);
+  } else {
+    kill(job->pid, SIGTERM);
+    waitpid(job->pid, NULL, 0);
+  }
+  forget_job(job);
+}
 
-  if (copy_recursive(src, dst, src, dst) != 0) {
-    exit(EXIT_FAILURE);
+void start_job(const char *src, char **dsts, int dst_count,
+               const struct JobOptions *opts) {
+  struct Job *job = NULL;
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].pid == 0) {
+      job = &jobs[i];
+      break;
+    }
+  }
+  if (job == NULL) {
+    printf("Too many children!!!\n");
+    return;
   }
 
-  monitor(src, dst);
+  pid_t pid = getpid();
+  int ctl[2] = {-1, -1};
+
+  if (loop) {
+    job->monitor = monitor_new(src, dsts, dst_count, opts, NULL);
+    job->monitor->in_loop = 1;
+    job->status = job->monitor->status;
+    if (loop_add_monitor(job->monitor) < 0) {
+      printf("Too many jobs in the event loop\n");
+      monitor_stop(job->monitor);
+      monitor_free(job->monitor);
+      job->monitor = NULL;
+      job->status = NULL;
+      return;
+    }
+  } else {
+    struct JobStatus *status =
+        mmap(NULL, sizeof(struct JobStatus), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (status == MAP_FAILED) {
+      perror("mmap");
+      return;
+    }
+    job_status_init(status, opts);
+    if (pipe(ctl) < 0) {
+      perror("pipe");
+      munmap(status, sizeof(struct JobStatus));
+      return;
+    }
 
-  exit(EXIT_SUCCESS);
-}
+    fflush(stdout);
+    pid = fork();
 
-void add_to_pids_list(pid_t pid, const char *src, const char *dst) {
-  for (int i = 0; i < MAX_JOBS; i++) {
-    if (pids[i] == 0) {
-      pids[i] = pid;
-      strncpy(pid_srcs[i], src, PATH_MAX);
-      strncpy(pid_dsts[i], dst, PATH_MAX);
+    if (pid < 0) {
+      perror("Fork error");
+      close(ctl[0]);
+      close(ctl[1]);
+      munmap(status, sizeof(struct JobStatus));
       return;
     }
+
+    if (pid == 0) {
+      close(ctl[1]);
+      for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].ctl_fd >= 0) {
+          close(jobs[i].ctl_fd);
+        }
+      }
+      child_work(src, dsts, dst_count, opts, ctl[0], status);
+      exit(EXIT_SUCCESS);
+    }
+    close(ctl[0]);
+    job->status = status;
+  }
+
+  job->pid = pid;
+  job->ctl_fd = ctl[1];
+  job->seen_events = 0;
+  job->seen_bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &job->seen_at);
+  strncpy(job->src, src, PATH_MAX - 1);
+  job->dst_count = dst_count;
+  for (int i = 0; i < dst_count; i++) {
+    job->dsts[i] = strdup(dsts[i]);
+    printf("Start PID %d: %s -> %s\n", pid, src, dsts[i]);
   }
-  printf("Too many children!!!\n");
 }
 
 void forkbomb_protector() {
   for (int i = 0; i < MAX_JOBS; i++) {
-    if (pids[i] != 0) {
-      pid_t result = waitpid(pids[i], NULL, WNOHANG);
+    if (jobs[i].pid != 0 && jobs[i].monitor == NULL) {
+      pid_t result = waitpid(jobs[i].pid, NULL, WNOHANG);
 
       if (result > 0 || (result == -1 && errno == ECHILD)) {
-        pids[i] = 0;
+        forget_job(&jobs[i]);
       }
     }
   }
@@ -632,15 +5827,146 @@ void parse_input(char *line) {
   }
 }
 
+// Parses the options in front of the source path of the add command.
+// Returns the index of the source argument or -1 on a bad option.
+// Parses a rate given as a whole non-negative number of units. Returns -1
+// for anything else, or when the rate does not fit.
+int parse_rate(const char *text, long long unit, long long *rate) {
+  char *end;
+  errno = 0;
+  long long count = strtoll(text, &end, 10);
+  if (errno != 0 || end == text || *end != '\0' || count < 0 ||
+      count > LLONG_MAX / unit) {
+    return -1;
+  }
+  *rate = count * unit;
+  return 0;
+}
+
+int parse_add_options(struct JobOptions *opts) {
+  opts->threads = DEFAULT_COPY_THREADS;
+  opts->quiet_ms = DEFAULT_QUIET_MS;
+  opts->hash_files = 0;
+  opts->delta_threshold = DEFAULT_DELTA_THRESHOLD_MIB * 1024LL * 1024;
+  opts->poll_ms = DEFAULT_POLL_MS;
+  opts->inotify_only = 0;
+  opts->durability = DURABILITY_OFF;
+  opts->commit_ms = DEFAULT_COMMIT_WINDOW_MS;
+  opts->commit_bytes = DEFAULT_COMMIT_WINDOW_MIB * 1024LL * 1024;
+  opts->rate_bytes = 0;
+  opts->rate_ops = 0;
+  opts->trace_entries = 0;
+
+  optind = 0;
+  int c;
+  while ((c = getopt(arg_count, args, "+j:q:Hd:p:iD:W:B:r:o:T:")) != -1) {
+    switch (c) {
+      case 'j':
+        opts->threads = atoi(optarg);
+        if (opts->threads < 1 || opts->threads > MAX_COPY_THREADS) {
+          printf("Error: thread count must be between 1 and %d\n",
+                 MAX_COPY_THREADS);
+          return -1;
+        }
+        break;
+      case 'q':
+        opts->quiet_ms = atoi(optarg);
+        if (opts->quiet_ms < 0) {
+          printf("Error: quiet period must not be negative\n");
+          return -1;
+        }
+        break;
+      case 'H':
+        opts->hash_files = 1;
+        break;
+      case 'd':
+        opts->delta_threshold = atoll(optarg) * 1024 * 1024;
+        if (opts->delta_threshold < 0) {
+          printf("Error: delta threshold must not be negative\n");
+          return -1;
+        }
+        break;
+      case 'p':
+        opts->poll_ms = atoi(optarg);
+        if (opts->poll_ms < RESCAN_POLL_MS) {
+          printf("Error: poll interval must be at least %d ms\n",
+                 RESCAN_POLL_MS);
+          return -1;
+        }
+        break;
+      case 'i':
+        opts->inotify_only = 1;
+        break;
+      case 'D':
+        if (strcmp(optarg, "syncfs") == 0) {
+          opts->durability = DURABILITY_SYNCFS;
+        }
+        else if (strcmp(optarg, "fsync") == 0) {
+          opts->durability = DURABILITY_FSYNC;
+        }
+        else {
+          printf("Error: durability mode must be syncfs or fsync\n");
+          return -1;
+        }
+        break;
+      case 'W':
+        opts->commit_ms = atoi(optarg);
+        if (opts->commit_ms < 0) {
+          printf("Error: commit window must not be negative\n");
+          return -1;
+        }
+        break;
+      case 'B':
+        opts->commit_bytes = atoll(optarg) * 1024 * 1024;
+        if (opts->commit_bytes < 1) {
+          printf("Error: commit window must be at least 1 MiB\n");
+          return -1;
+        }
+        break;
+      case 'r':
+        if (parse_rate(optarg, 1024 * 1024, &opts->rate_bytes) < 0) {
+          printf("Error: byte rate must be a whole number of MiB/s\n");
+          return -1;
+        }
+        break;
+      case 'o':
+        if (parse_rate(optarg, 1, &opts->rate_ops) < 0) {
+          printf("Error: I/O rate must be a whole number of operations/s\n");
+          return -1;
+        }
+        break;
+      case 'T':
+        opts->trace_entries = atoi(optarg);
+        if (opts->trace_entries < 1 ||
+            opts->trace_entries > MAX_TRACE_ENTRIES) {
+          printf("Error: trace size must be between 1 and %d steps\n",
+                 MAX_TRACE_ENTRIES);
+          return -1;
+        }
+        break;
+      default:
+        return -1;
+    }
+  }
+  return optind;
+}
+
 void cmd_add() {
-  if (arg_count < 3) {
-    printf("Usage: add <source> <backup> <backup2> ...\n");
+  struct JobOptions opts;
+  int first = parse_add_options(&opts);
+
+  if (first < 0 || arg_count - first < 2) {
+    printf(
+        "Usage: add [-j threads] [-q quiet_ms] [-H] [-d delta_mib] "
+        "[-p poll_ms] [-i] [-D syncfs|fsync] [-W window_ms] "
+        "[-B window_mib] [-r mib_per_sec] [-o iops] [-T trace_steps] "
+        "<source> <backup> <backup2> ...\n");
     return;
   }
 
   char abs_src[PATH_MAX];
 
-  if (make_absolute_path(args[1], abs_src) != 0) {
+  if (make_absolute_path(args[first], abs_src) != 0) {
     printf("Source path error\n");
     return;
   }
@@ -652,7 +5978,11 @@ void cmd_add() {
     return;
   }
 
-  for (int i = 2; i < arg_count; i++) {
+  struct Job *job = find_job(abs_src);
+  char *new_dsts[MAX_DESTINATIONS];
+  int new_count = 0;
+
+  for (int i = first + 1; i < arg_count; i++) {
     char *target = args[i];
     char abs_dst[PATH_MAX];
     int created_new = 0;
@@ -683,13 +6013,11 @@ void cmd_add() {
       }
     }
 
-    int duplicate = 0;
+    int duplicate = find_job_dst(job, abs_dst) >= 0;
 
-    for (int j = 0; j < MAX_JOBS; j++) {
-      if (pids[j] != 0 && strcmp(pid_srcs[j], abs_src) == 0 &&
-          strcmp(pid_dsts[j], abs_dst) == 0) {
+    for (int j = 0; j < new_count; j++) {
+      if (strcmp(new_dsts[j], abs_dst) == 0) {
         duplicate = 1;
-        break;
       }
     }
 
@@ -701,30 +6029,58 @@ void cmd_add() {
     if (!created_new) {
       struct stat dst_st;
       if (lstat(abs_dst, &dst_st) == 0) {
-        if (!S_ISDIR(dst_st.st_mode) || !is_dir_empty(abs_dst)) {
+        if (S_ISDIR(dst_st.st_mode) && has_manifest(abs_dst)) {
+          printf("Resuming backup in '%s'\n", abs_dst);
+        }
+        else if (!S_ISDIR(dst_st.st_mode) || !is_dir_empty(abs_dst)) {
           printf("Error: Destination '%s' is not empty.\n", abs_dst);
           continue;
         }
       }
     }
 
-    pid_t pid = fork();
-
-    if (pid < 0) {
-      perror("Fork error");
-      continue;
+    if (new_count + (job ? job->dst_count : 0) >= MAX_DESTINATIONS) {
+      printf("Error: Too many destinations for '%s'\n", abs_src);
+      break;
     }
 
-    if (pid == 0) {
-      child_work(abs_src, abs_dst);
-      exit(EXIT_SUCCESS);
-    }
+    new_dsts[new_count++] = strdup(abs_dst);
+  }
 
-    else {
-      printf("Start PID %d: %s -> %s\n", pid, abs_src, abs_dst);
-      add_to_pids_list(pid, abs_src, abs_dst);
+  if (job == NULL) {
+    if (new_count > 0) {
+      start_job(abs_src, new_dsts, new_count, &opts);
+    }
+  } else {
+    // One watcher per source: a running job just gets more destinations.
+    for (int i = 0; i < new_count; i++) {
+      if (send_control(job, 'A', new_dsts[i], opts.threads) == 0) {
+        job->dsts[job->dst_count++] = strdup(new_dsts[i]);
+        printf("Add PID %d: %s -> %s\n", job->pid, abs_src, new_dsts[i]);
+      }
     }
   }
+
+  for (int i = 0; i < new_count; i++) {
+    free(new_dsts[i]);
+  }
+}
+
+// Prints the rates of limit and how long it held writers back.
+void print_limit(struct RateLimit *limit) {
+  long long bytes = atomic_load(&limit->bytes_per_sec);
+  long long ops = atomic_load(&limit->ops_per_sec);
+  printf(" | limit ");
+  if (bytes > 0) {
+    printf("%lld MiB/s ", bytes / (1024 * 1024));
+  }
+  if (ops > 0) {
+    printf("%lld IOPS ", ops);
+  }
+  if (bytes <= 0 && ops <= 0) {
+    printf("off ");
+  }
+  printf("throttled %.1f s", atomic_load(&limit->throttled_ns) / 1e9);
 }
 
 void cmd_list() {
@@ -733,14 +6089,266 @@ void cmd_list() {
   printf("Active processes:\n");
   int found = 0;
   for (int i = 0; i < MAX_JOBS; i++) {
-    if (pids[i] != 0) {
-      printf("[%d] PID: %d | %s -> %s\n", i, pids[i], pid_srcs[i], pid_dsts[i]);
+    for (int j = 0; jobs[i].pid != 0 && j < jobs[i].dst_count; j++) {
+      printf("[%d] PID: %d | %s -> %s", i, jobs[i].pid, jobs[i].src,
+             jobs[i].dsts[j]);
+      struct JobStatus *status = jobs[i].status;
+      if (status && status->durability != DURABILITY_OFF) {
+        printf(" | durable up to #%llu of #%llu",
+               (unsigned long long)atomic_load(&status->durable_seq),
+               (unsigned long long)atomic_load(&status->replicated_seq));
+      }
+      if (status && (rate_limited(&status->limit) ||
+                     atomic_load(&status->limit.throttled_ns) > 0)) {
+        print_limit(&status->limit);
+      }
+      printf("\n");
       found = 1;
     }
   }
   if (!found) {
     printf("None.\n");
   }
+  if (rate_limited(global_limit)) {
+    printf("All jobs");
+    print_limit(global_limit);
+    printf("\n");
+  }
+}
+
+// Prints the latency percentiles of the steps a job finished so far.
+void print_latency(struct JobStatus *status) {
+  unsigned long long counts[LATENCY_BUCKETS];
+  unsigned long long total = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    counts[i] = atomic_load_explicit(&status->latency[i],
+                                     memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) {
+    return;
+  }
+
+  const double quantiles[] = {0.5, 0.99, 0.999};
+  const char *names[] = {"p50", "p99", "p999"};
+  printf("  latency   ");
+  unsigned long long seen = 0;
+  int bucket = 0;
+  for (int q = 0; q < 3; q++) {
+    unsigned long long rank = quantiles[q] * total;
+    if (rank == 0) {
+      rank = 1;
+    }
+    while (seen + counts[bucket] < rank) {
+      seen += counts[bucket++];
+    }
+    printf(" %s %.3f ms%s", names[q], latency_bucket_max(bucket) / 1e6,
+           q < 2 ? "," : "");
+  }
+  printf(" of %llu steps\n", total);
+}
+
+// Shows what every job is doing, read straight from the counters it
+// shares. Rates are since the previous stats.
+void cmd_stats() {
+  forkbomb_protector();
+
+  int found = 0;
+  for (int i = 0; i < MAX_JOBS; i++) {
+    struct JobStatus *status = jobs[i].status;
+    if (jobs[i].pid == 0 || status == NULL) {
+      continue;
+    }
+    found = 1;
+
+    double secs = elapsed_ns(&jobs[i].seen_at) / 1e9;
+    unsigned long long events = atomic_load(&status->events);
+    unsigned long long bytes = atomic_load(&status->bytes_written);
+    unsigned long long oldest = atomic_load(&status->oldest_event_ns);
+    unsigned long long now = monotonic_ns();
+    double lag = oldest && now > oldest ? (now - oldest) / 1e9 : 0.0;
+
+    printf("[%d] PID: %d | %s\n", i, jobs[i].pid, jobs[i].src);
+    printf("  events     %llu, %.1f/s\n", events,
+           secs > 0 ? (events - jobs[i].seen_events) / secs : 0.0);
+    printf("  written    %llu files, %.1f MiB, %.1f MiB/s, %llu errors\n",
+           (unsigned long long)atomic_load(&status->files_replicated),
+           bytes / (1024.0 * 1024.0),
+           secs > 0 ? (bytes - jobs[i].seen_bytes) / secs / (1024 * 1024)
+                    : 0.0,
+           (unsigned long long)atomic_load(&status->errors));
+    printf("  backlog    %d steps, %d files settling, lag %.1f s\n",
+           atomic_load(&status->pending_steps),
+           atomic_load(&status->dirty_files), lag);
+    print_latency(status);
+    if (atomic_load(&status->fanotify)) {
+      printf("  watching   the whole filesystem\n");
+    } else {
+      printf("  watching   %d directories, %d subtrees polled\n",
+             atomic_load(&status->watches), atomic_load(&status->polled));
+    }
+
+    jobs[i].seen_events = events;
+    jobs[i].seen_bytes = bytes;
+    clock_gettime(CLOCK_MONOTONIC, &jobs[i].seen_at);
+  }
+  if (!found) {
+    printf("None.\n");
+  }
+}
+
+// A sync the parent waits for: marker names the file created in the
+// source of job.
+struct SyncWait {
+  int active;
+  struct Job *job;
+  unsigned long long marker;
+  char marker_path[PATH_MAX];
+  struct timespec start;
+  long long timeout_ms;
+};
+
+struct SyncWait sync_wait;
+unsigned long long sync_counter;
+
+// Checks whether the job replicated everything up to the marker. Returns
+// 1 once the sync is over, done or timed out.
+int sync_wait_step() {
+  struct Job *job = sync_wait.job;
+  struct JobStatus *status = job->status;
+  int passed = 0;
+  if (job->pid != 0 && status != NULL) {
+    passed = atomic_load(&status->sync_marker) >= sync_wait.marker &&
+             atomic_load(&status->replicated_seq) >=
+                 atomic_load(&status->sync_seq) &&
+             atomic_load(&status->catching_up) == 0 &&
+             !atomic_load(&status->rescan_pending);
+  }
+
+  double secs = elapsed_ns(&sync_wait.start) / 1e9;
+  if (!passed && job->pid != 0 && secs * 1000 < sync_wait.timeout_ms &&
+      main_keep_running) {
+    return 0;
+  }
+
+  unlink(sync_wait.marker_path);
+  if (passed) {
+    printf("Synced %s in %.3f s\n", job->src, secs);
+  } else {
+    printf("Sync of %s gave up after %.3f s\n", job->src, secs);
+  }
+  fflush(stdout);
+  sync_wait.active = 0;
+  return 1;
+}
+
+// Waits until the job of a source replicated every change made before
+// the command. A marker created in the source orders the wait after those
+// changes in the job's event stream.
+void cmd_sync() {
+  long long timeout_ms = DEFAULT_SYNC_TIMEOUT_S * 1000LL;
+  optind = 0;
+  int c;
+  while ((c = getopt(arg_count, args, "+t:")) != -1) {
+    if (c != 't' || atof(optarg) <= 0) {
+      optind = arg_count;
+      break;
+    }
+    timeout_ms = atof(optarg) * 1000;
+  }
+  if (optind >= arg_count) {
+    printf("Usage: sync [-t timeout_s] <source> [backup] ...\n");
+    return;
+  }
+
+  char abs_src[PATH_MAX];
+  if (make_absolute_path(args[optind], abs_src) != 0) {
+    printf("Source path error\n");
+    return;
+  }
+  struct Job *job = find_job(abs_src);
+  if (job == NULL || job->status == NULL) {
+    printf("No job watches %s\n", abs_src);
+    return;
+  }
+  // Every backup of a source is fed by the same events, so they finish
+  // together; named backups only have to belong to the job.
+  for (int i = optind + 1; i < arg_count; i++) {
+    char abs_dst[PATH_MAX];
+    if (make_absolute_path(args[i], abs_dst) != 0 ||
+        find_job_dst(job, abs_dst) < 0) {
+      printf("%s is not a backup of %s\n", args[i], abs_src);
+      return;
+    }
+  }
+
+  sync_wait.job = job;
+  sync_wait.marker = ++sync_counter;
+  sync_wait.timeout_ms = timeout_ms;
+  if (snprintf(sync_wait.marker_path, sizeof(sync_wait.marker_path),
+               "%s/" SYNC_PREFIX "%d.%llu", abs_src, job->status->owner,
+               sync_wait.marker) >= (int)sizeof(sync_wait.marker_path)) {
+    printf("Source path error\n");
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &sync_wait.start);
+
+  int fd = TEMP_FAILURE_RETRY(open(
+      sync_wait.marker_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+  if (fd < 0) {
+    perror("open marker");
+    return;
+  }
+  TEMP_FAILURE_RETRY(close(fd));
+  sync_wait.active = 1;
+
+  // The event loop keeps running the jobs and finishes the wait itself.
+  if (loop) {
+    loop_watch_stdin(0);
+    return;
+  }
+  while (!sync_wait_step()) {
+    struct timespec pause = {0, SYNC_POLL_MS * 1000000L};
+    nanosleep(&pause, NULL);
+  }
+}
+
+// Changes the I/O limit of a running job, or of all jobs, on the fly.
+void cmd_limit() {
+  if (arg_count < 3 || arg_count > 4) {
+    printf("Usage: limit <source>|all <mib_per_sec> [iops]\n");
+    return;
+  }
+
+  // A typo must not lift the limit, as atoll reading it as 0 would.
+  long long bytes;
+  long long ops = 0;
+  if (parse_rate(args[2], 1024 * 1024, &bytes) < 0 ||
+      (arg_count == 4 && parse_rate(args[3], 1, &ops) < 0)) {
+    printf("Error: rates must be whole non-negative numbers\n");
+    return;
+  }
+
+  struct RateLimit *limit = global_limit;
+  if (strcmp(args[1], "all") != 0) {
+    char abs_src[PATH_MAX];
+    if (make_absolute_path(args[1], abs_src) != 0) {
+      printf("Source path error\n");
+      return;
+    }
+    struct Job *job = find_job(abs_src);
+    if (job == NULL || job->status == NULL) {
+      printf("No job watches %s\n", abs_src);
+      return;
+    }
+    limit = &job->status->limit;
+  }
+
+  atomic_store(&limit->bytes_per_sec, bytes);
+  atomic_store(&limit->ops_per_sec, ops);
+  printf("Limit %s", args[1]);
+  print_limit(limit);
+  printf("\n");
 }
 
 void cmd_end() {
@@ -765,62 +6373,99 @@ void cmd_end() {
       strncpy(abs_dst, dst_arg, PATH_MAX);
     }
 
-    for (int j = 0; j < MAX_JOBS; j++) {
-      if (pids[j] != 0 && strcmp(pid_srcs[j], abs_src) == 0 &&
-          strcmp(pid_dsts[j], abs_dst) == 0) {
-        kill(pids[j], SIGTERM);
-        waitpid(pids[j], NULL, 0);
-        printf("Stop PID %d: %s -> %s\n", pids[j], pid_srcs[j], pid_dsts[j]);
-        pids[j] = 0;
-      }
-    }
-  }
-}
-
-int restore_copy(const char *backup_base, const char *src_base,
-                 const char *root_backup, const char *root_src) {
-  DIR *d;
+    struct Job *job = find_job(abs_src);
+    int idx = find_job_dst(job, abs_dst);
 
-  if ((d = opendir(backup_base)) == NULL) {
-    return -1;
-  }
+    if (idx < 0) {
+      continue;
+    }
 
-  struct stat st_backup_base;
+    pid_t pid = job->pid;
 
-  if (lstat(backup_base, &st_backup_base) == 0) {
-    if (mkdir(src_base, st_backup_base.st_mode) < 0 && errno != EEXIST) {
+    if (job->dst_count == 1) {
+      stop_job(job);
+    } else {
+      send_control(job, 'R', abs_dst, 0);
+      free(job->dsts[idx]);
+      memmove(&job->dsts[idx], &job->dsts[idx + 1],
+              (job->dst_count - idx - 1) * sizeof(char *));
+      job->dst_count--;
     }
+    printf("Stop PID %d: %s -> %s\n", pid, abs_src, abs_dst);
   }
+}
 
-  struct dirent *entry;
+// Copies the backup directory backup_base, open as backup_fd, over the
+// source directory src_base, open as src_fd.
+int restore_copy(int backup_fd, int src_fd, const char *backup_base,
+                 const char *src_base, const char *root_backup,
+                 const char *root_src, struct LinkMap *links) {
+  int fd = TEMP_FAILURE_RETRY(dup(backup_fd));
+  if (fd < 0) {
+    return -1;
+  }
 
-  while ((entry = readdir(d)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+  struct DirReader dir;
+  struct dirent64 *entry;
+  dir_open(&dir, fd);
+  while ((entry = dir_next(&dir)) != NULL) {
+    const char *name = entry->d_name;
+    if ((strcmp(backup_base, root_backup) == 0 && is_meta_name(name)) ||
+        is_temp_name(name)) {
       continue;
     }
 
     char backup_path[PATH_MAX];
     char src_path[PATH_MAX];
 
-    snprintf(backup_path, sizeof(backup_path), "%s/%s", backup_base,
-             entry->d_name);
-    snprintf(src_path, sizeof(src_path), "%s/%s", src_base, entry->d_name);
+    snprintf(backup_path, sizeof(backup_path), "%s/%s", backup_base, name);
+    snprintf(src_path, sizeof(src_path), "%s/%s", src_base, name);
 
     struct stat st_backup;
 
-    if (lstat(backup_path, &st_backup) < 0) {
+    if (fstatat(fd, name, &st_backup, AT_SYMLINK_NOFOLLOW) < 0) {
       continue;
     }
 
     if (S_ISDIR(st_backup.st_mode)) {
-      restore_copy(backup_path, src_path, root_backup, root_src);
+      mkdirat(src_fd, name, st_backup.st_mode);
+
+      int child_backup = open_dir_at(fd, name);
+      int child_src = open_dir_at(src_fd, name);
+      if (child_backup >= 0 && child_src >= 0) {
+        restore_copy(child_backup, child_src, backup_path, src_path,
+                     root_backup, root_src, links);
+      }
+      if (child_backup >= 0) {
+        TEMP_FAILURE_RETRY(close(child_backup));
+      }
+      if (child_src >= 0) {
+        TEMP_FAILURE_RETRY(close(child_src));
+      }
     }
 
     else if (S_ISREG(st_backup.st_mode)) {
+      // Backups linked together are restored as links too.
+      const char *rel = backup_path + strlen(root_backup);
+      const char *first =
+          st_backup.st_nlink > 1
+              ? claim_link(links, root_backup, rel, &st_backup)
+              : NULL;
+      if (first) {
+        char target[PATH_MAX];
+        snprintf(target, sizeof(target), "%s%s", root_src, first);
+        if (same_inode(target, src_path) ||
+            ((unlinkat(src_fd, name, 0) == 0 || errno == ENOENT) &&
+             link(target, src_path) == 0)) {
+          continue;
+        }
+      }
+
       struct stat st_src;
       int need_copy = 1;
 
-      if (lstat(src_path, &st_src) == 0 && S_ISREG(st_src.st_mode)) {
+      if (fstatat(src_fd, name, &st_src, AT_SYMLINK_NOFOLLOW) == 0 &&
+          S_ISREG(st_src.st_mode)) {
         if (st_src.st_size == st_backup.st_size &&
             st_src.st_mtime == st_backup.st_mtime) {
           need_copy = 0;
@@ -832,68 +6477,49 @@ int restore_copy(const char *backup_base, const char *src_base,
       }
 
     } else if (S_ISLNK(st_backup.st_mode)) {
-      char target[PATH_MAX];
-      ssize_t len = readlink(backup_path, target, sizeof(target) - 1);
-      if (len != -1) {
-        target[len] = '\0';
-        unlink(src_path);
-        if (strncmp(target, root_backup, strlen(root_backup)) == 0) {
-          char new_target[PATH_MAX];
-          snprintf(new_target, sizeof(new_target), "%s%s", root_src,
-                   target + strlen(root_backup));
-          TEMP_FAILURE_RETRY(symlink(new_target, src_path));
-        } else {
-          TEMP_FAILURE_RETRY(symlink(target, src_path));
-        }
-      }
+      copy_symlink(backup_path, src_path, root_backup, root_src);
     }
   }
-
-  if (closedir(d)) {
-    return -1;
-  }
+  dir_close(&dir);
 
   return 0;
 }
 
-int restore_clean(const char *src_base, const char *backup_base) {
-  DIR *d;
-
-  if ((d = opendir(src_base)) == NULL) {
+// Removes what the source directory src_fd holds but the backup
+// directory backup_fd does not.
+int restore_clean(int src_fd, int backup_fd) {
+  int fd = TEMP_FAILURE_RETRY(dup(src_fd));
+  if (fd < 0) {
     return -1;
   }
 
-  struct dirent *entry;
-
-  while ((entry = readdir(d)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
-    }
-
-    char src_path[PATH_MAX];
-    char backup_path[PATH_MAX];
-
-    snprintf(src_path, sizeof(src_path), "%s/%s", src_base, entry->d_name);
-    snprintf(backup_path, sizeof(backup_path), "%s/%s", backup_base,
-             entry->d_name);
-
+  struct DirReader dir;
+  struct dirent64 *entry;
+  dir_open(&dir, fd);
+  while ((entry = dir_next(&dir)) != NULL) {
+    const char *name = entry->d_name;
     struct stat st_backup;
 
-    if (lstat(backup_path, &st_backup) < 0) {
-      remove_recursive(src_path);
+    if (fstatat(backup_fd, name, &st_backup, AT_SYMLINK_NOFOLLOW) < 0) {
+      remove_at(fd, name);
     }
 
-    else {
-      struct stat st_src;
-      if (lstat(src_path, &st_src) == 0 && S_ISDIR(st_src.st_mode)) {
-        restore_clean(src_path, backup_path);
+    else if (S_ISDIR(st_backup.st_mode) &&
+             dir_entry_type(fd, entry) == DT_DIR) {
+      int child_src = open_dir_at(fd, name);
+      int child_backup = open_dir_at(backup_fd, name);
+      if (child_src >= 0 && child_backup >= 0) {
+        restore_clean(child_src, child_backup);
+      }
+      if (child_src >= 0) {
+        TEMP_FAILURE_RETRY(close(child_src));
+      }
+      if (child_backup >= 0) {
+        TEMP_FAILURE_RETRY(close(child_backup));
       }
     }
   }
-
-  if (closedir(d)) {
-    return -1;
-  }
+  dir_close(&dir);
 
   return 0;
 }
@@ -924,25 +6550,220 @@ void cmd_restore() {
     return;
   }
 
-  for (int j = 0; j < MAX_JOBS; j++) {
-    if (pids[j] != 0 && strcmp(pid_srcs[j], abs_src) == 0 &&
-        strcmp(pid_dsts[j], abs_backup) == 0) {
-      printf("Error: You are watching '%s' by '%s'\n", pid_srcs[j],
-             pid_dsts[j]);
-      return;
-    }
+  if (find_job_dst(find_job(abs_src), abs_backup) >= 0) {
+    printf("Error: You are watching '%s' by '%s'\n", abs_src, abs_backup);
+    return;
   }
 
   printf("Restoring: %s -> %s\n", abs_backup, abs_src);
 
-  restore_copy(abs_backup, abs_src, abs_backup, abs_src);
+  int backup_fd = open_dir_at(AT_FDCWD, abs_backup);
+  int src_fd = open_dir_at(AT_FDCWD, abs_src);
+  if (backup_fd < 0 || src_fd < 0) {
+    perror("open");
+    if (backup_fd >= 0) {
+      TEMP_FAILURE_RETRY(close(backup_fd));
+    }
+    if (src_fd >= 0) {
+      TEMP_FAILURE_RETRY(close(src_fd));
+    }
+    return;
+  }
+
+  struct LinkMap links = {0};
+  restore_copy(backup_fd, src_fd, abs_backup, abs_src, abs_backup, abs_src,
+               &links);
+  free_links(&links);
 
-  restore_clean(abs_src, abs_backup);
+  restore_clean(src_fd, backup_fd);
+  TEMP_FAILURE_RETRY(close(backup_fd));
+  TEMP_FAILURE_RETRY(close(src_fd));
 
   printf("Done.\n");
 }
 
-int main() {
+#ifndef SOP_BACKUP_NO_MAIN
+void print_help() {
+  printf("Interactive backups - Available commands:\n");
+  printf(
+      "add [-j threads] [-q quiet_ms] [-H] [-d delta_mib] [-p poll_ms] [-i] "
+      "[-D syncfs|fsync] [-W window_ms] [-B window_mib] [-r mib_per_sec] "
+      "[-o iops] [-T trace_steps] <source> <dst1> <dst2> ... - adds "
+      "watching a directory\n");
+  printf("list - shows current active watchers\n");
+  printf("stats - shows throughput, backlog and lag of every watcher\n");
+  printf(
+      "sync [-t timeout_s] <source> [dst1] ... - waits until the backups "
+      "have every change made so far\n");
+  printf(
+      "limit <source>|all <mib_per_sec> [iops] - limits the I/O of a job or "
+      "of all jobs, 0 lifts the limit\n");
+  printf("end <source> <dst1> ... - stops watching a directory\n");
+  printf("restore <source> <backup> - restores a backup to a source\n");
+  printf("exit - ends the program\n");
+}
+
+// Returns 0 when the program should exit.
+int run_command(char *line) {
+  parse_input(line);
+  if (arg_count == 0) {
+    return 1;
+  }
+
+  int result = 1;
+
+  if (strcmp(args[0], "exit") == 0) {
+    result = 0;
+  }
+
+  else if (strcmp(args[0], "add") == 0) {
+    cmd_add();
+  }
+
+  else if (strcmp(args[0], "list") == 0) {
+    cmd_list();
+  }
+
+  else if (strcmp(args[0], "limit") == 0) {
+    cmd_limit();
+  }
+
+  else if (strcmp(args[0], "stats") == 0) {
+    cmd_stats();
+  }
+
+  else if (strcmp(args[0], "sync") == 0) {
+    cmd_sync();
+  }
+
+  else if (strcmp(args[0], "end") == 0) {
+    cmd_end();
+  }
+
+  else if (strcmp(args[0], "restore") == 0) {
+    cmd_restore();
+  }
+
+  else {
+    printf("Unknown command\n");
+  }
+
+  clear_args();
+  fflush(stdout);
+  return result;
+}
+
+char pending[MAX_CMD_LEN];
+size_t pending_len = 0;
+
+// Runs the complete lines read so far, stopping after a sync that has to
+// finish first. Returns 0 on exit.
+int loop_run_lines() {
+  char *start = pending;
+  char *newline;
+  while (!sync_wait.active &&
+         (newline = memchr(start, '\n', pending + pending_len - start))) {
+    *newline = '\0';
+    if (!run_command(start)) {
+      return 0;
+    }
+    start = newline + 1;
+  }
+
+  pending_len -= start - pending;
+  memmove(pending, start, pending_len);
+  if (pending_len == sizeof(pending) - 1) {
+    printf("Command too long\n");
+    pending_len = 0;
+  }
+  return 1;
+}
+
+// Reads whatever stdin has and runs every complete line. Returns 0 on EOF
+// or exit.
+int loop_read_stdin() {
+  ssize_t len = read(STDIN_FILENO, pending + pending_len,
+                     sizeof(pending) - 1 - pending_len);
+  if (len < 0) {
+    return errno == EINTR || errno == EAGAIN;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  pending_len += len;
+  return loop_run_lines();
+}
+
+void event_loop() {
+  struct epoll_event events[64];
+
+  while (main_keep_running) {
+    if (dump_trace) {
+      dump_trace = 0;
+      for (int i = 0; i < loop->monitor_count; i++) {
+        write_trace(loop->monitors[i]);
+      }
+    }
+
+    int timeout = loop_timeout();
+    if (sync_wait.active && (timeout < 0 || timeout > SYNC_POLL_MS)) {
+      timeout = SYNC_POLL_MS;
+    }
+    int ready = epoll_wait(loop->epoll_fd, events, 64, timeout);
+
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.ptr == NULL) {
+        if (!loop_read_stdin()) {
+          main_keep_running = 0;
+        }
+      } else if (events[i].data.ptr == loop) {
+        loop_collect();
+      } else {
+        struct Monitor *m = events[i].data.ptr;
+        if (!m->loop_busy) {
+          loop_dispatch(m);
+        }
+      }
+    }
+
+    // Commands typed behind a sync run once it is over.
+    if (sync_wait.active && sync_wait_step()) {
+      loop_watch_stdin(1);
+      if (!loop_run_lines()) {
+        main_keep_running = 0;
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int copiers = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "e::")) != -1) {
+    switch (c) {
+      case 'e':
+        copiers = optarg ? atoi(optarg) : DEFAULT_LOOP_COPIERS;
+        if (copiers < 1 || copiers > MAX_COPY_THREADS) {
+          fprintf(stderr, "copier count must be between 1 and %d\n",
+                  MAX_COPY_THREADS);
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-e[copiers]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
   sethandler(main_handler, SIGINT);
   sethandler(main_handler, SIGTERM);
 
@@ -957,19 +6778,35 @@ int main() {
   }
 
   for (int i = 0; i < MAX_JOBS; i++) {
-    pids[i] = 0;
+    jobs[i].pid = 0;
+    jobs[i].ctl_fd = -1;
   }
 
+  // Mapped before the first job starts, so every job shares it.
+  global_limit = mmap(NULL, sizeof(struct RateLimit), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (global_limit == MAP_FAILED) {
+    ERR("mmap");
+  }
+  rate_limit_init(global_limit, 0, 0);
+
   char line[MAX_CMD_LEN];
 
-  printf("Interactive backups - Available commands:\n");
-  printf("add <source> <dst1> <dst2> ... - adds watching a directory\n");
-  printf("list - shows current active watchers\n");
-  printf("end <source> <dst1> ... - stops watching a directory\n");
-  printf("restore <source> <backup> - restores a backup to a source\n");
-  printf("exit - ends the program\n");
+  print_help();
+  fflush(stdout);
 
-  while (main_keep_running) {
+  if (copiers > 0) {
+    // In-process jobs dump their traces from the loop.
+    sethandler(trace_handler, SIGUSR1);
+    sigdelset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1) {
+      ERR("sigprocmask");
+    }
+    loop_init(copiers);
+    event_loop();
+  }
+
+  while (loop == NULL && main_keep_running) {
     forkbomb_protector();
 
     if (fgets(line, sizeof(line), stdin) == NULL) {
@@ -979,44 +6816,22 @@ int main() {
       break;
     }
 
-    parse_input(line);
-    if (arg_count == 0) {
-      continue;
-    }
-
-    if (strcmp(args[0], "exit") == 0) {
+    if (!run_command(line)) {
       break;
     }
-
-    else if (strcmp(args[0], "add") == 0) {
-      cmd_add();
-    }
-
-    else if (strcmp(args[0], "list") == 0) {
-      cmd_list();
-    }
-
-    else if (strcmp(args[0], "end") == 0) {
-      cmd_end();
-    }
-
-    else if (strcmp(args[0], "restore") == 0) {
-      cmd_restore();
-    }
-
-    else {
-      printf("Unknown command\n");
-    }
-
-    clear_args();
   }
 
   printf("\nFinish\n");
   for (int i = 0; i < MAX_JOBS; i++) {
-    if (pids[i] != 0) {
-      kill(pids[i], SIGTERM);
+    if (jobs[i].pid != 0 && jobs[i].monitor == NULL) {
+      kill(jobs[i].pid, SIGTERM);
     }
   }
+  if (loop) {
+    fflush(stdout);
+    loop_shutdown();
+  }
   clear_args();
   return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,132 @@
+// Checks that a sparse file stays sparse through a backup and a restore:
+// neither the backup nor the restored file may take more blocks than the
+// source, and both must hold the same bytes.
+#define SOP_BACKUP_NO_MAIN
+#include "../src/projekt.c"
+
+#define SPARSE_SIZE (64LL * 1024 * 1024)
+#define SPARSE_CHUNK (64 * 1024)
+
+void write_chunk(int fd, off_t offset, unsigned char fill) {
+  char buf[SPARSE_CHUNK];
+  memset(buf, fill, sizeof(buf));
+  if (pwrite_all(fd, buf, sizeof(buf), offset)) {
+    ERR("pwrite");
+  }
+}
+
+void make_sparse(const char *path) {
+  int fd = TEMP_FAILURE_RETRY(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  if (fd < 0) {
+    ERR("open");
+  }
+  if (ftruncate(fd, SPARSE_SIZE) < 0) {
+    ERR("ftruncate");
+  }
+  write_chunk(fd, 0, 'a');
+  write_chunk(fd, SPARSE_SIZE / 2, 'b');
+  write_chunk(fd, SPARSE_SIZE - SPARSE_CHUNK, 'c');
+  TEMP_FAILURE_RETRY(close(fd));
+}
+
+int same_bytes(const char *a, const char *b) {
+  int fa = TEMP_FAILURE_RETRY(open(a, O_RDONLY));
+  int fb = TEMP_FAILURE_RETRY(open(b, O_RDONLY));
+  int same = fa >= 0 && fb >= 0;
+  char buf_a[SPARSE_CHUNK];
+  char buf_b[SPARSE_CHUNK];
+
+  while (same) {
+    ssize_t len_a = bulk_read(fa, buf_a, sizeof(buf_a));
+    ssize_t len_b = bulk_read(fb, buf_b, sizeof(buf_b));
+    same = len_a == len_b && len_a >= 0 && memcmp(buf_a, buf_b, len_a) == 0;
+    if (len_a <= 0) {
+      break;
+    }
+  }
+  if (fa >= 0) {
+    TEMP_FAILURE_RETRY(close(fa));
+  }
+  if (fb >= 0) {
+    TEMP_FAILURE_RETRY(close(fb));
+  }
+  return same;
+}
+
+// Returns 1 when path is a faithful, no less sparse copy of src.
+int check_copy(const char *what, const char *src, const char *path) {
+  struct stat src_st;
+  struct stat st;
+  if (stat(src, &src_st) < 0 || stat(path, &st) < 0) {
+    ERR("stat");
+  }
+  printf("%-8s %lld bytes, %lld blocks\n", what, (long long)st.st_size,
+         (long long)st.st_blocks);
+
+  int ok = 1;
+  if (st.st_blocks > src_st.st_blocks) {
+    fprintf(stderr, "%s takes %lld blocks, the source only %lld\n", what,
+            (long long)st.st_blocks, (long long)src_st.st_blocks);
+    ok = 0;
+  }
+  if (!same_bytes(src, path)) {
+    fprintf(stderr, "%s differs from the source\n", what);
+    ok = 0;
+  }
+  return ok;
+}
+
+int main() {
+  char base[] = "/tmp/sop-sparse-test-XXXXXX";
+  if (mkdtemp(base) == NULL) {
+    ERR("mkdtemp");
+  }
+
+  char src[PATH_MAX];
+  char backup[PATH_MAX];
+  char restored[PATH_MAX];
+  snprintf(src, sizeof(src), "%s/source", base);
+  snprintf(backup, sizeof(backup), "%s/backup", base);
+  snprintf(restored, sizeof(restored), "%s/restored", base);
+  if (mkdir(src, 0755) < 0 || mkdir(backup, 0755) < 0 ||
+      mkdir(restored, 0755) < 0) {
+    ERR("mkdir");
+  }
+
+  char src_file[PATH_MAX];
+  char backup_file[PATH_MAX];
+  char restored_file[PATH_MAX];
+  snprintf(src_file, sizeof(src_file), "%s/source/sparse", base);
+  snprintf(backup_file, sizeof(backup_file), "%s/backup/sparse", base);
+  snprintf(restored_file, sizeof(restored_file), "%s/restored/sparse", base);
+  make_sparse(src_file);
+
+  args[arg_count++] = (char *)"add";
+  struct JobOptions opts;
+  parse_add_options(&opts);
+  struct Destination *dst = new_destination(backup, src, &opts);
+  if (copy_tree(src, "", &dst, 1, opts.threads, NULL) != 0) {
+    ERR("copy_tree");
+  }
+  free_destination(dst);
+
+  int backup_fd = open_dir_at(AT_FDCWD, backup);
+  int restored_fd = open_dir_at(AT_FDCWD, restored);
+  if (backup_fd < 0 || restored_fd < 0) {
+    ERR("open");
+  }
+  struct LinkMap links = {0};
+  restore_copy(backup_fd, restored_fd, backup, restored, backup, restored,
+               &links);
+  free_links(&links);
+  TEMP_FAILURE_RETRY(close(backup_fd));
+  TEMP_FAILURE_RETRY(close(restored_fd));
+
+  check_copy("source", src_file, src_file);
+  int ok = check_copy("backup", src_file, backup_file);
+  ok = check_copy("restored", src_file, restored_file) && ok;
+
+  remove_recursive(base);
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}